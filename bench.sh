@@ -0,0 +1,70 @@
+#!/bin/sh
+# usage: bench.sh [files] [commits] [file size] [runs]
+# times the custom git client against a synthetic repo over the local transport,
+# with an empty cache (cold), after a new commit (warm) and with nothing to do (no-change)
+
+set -e
+files="${1:-1000}"
+commits="${2:-20}"
+size="${3:-4096}"
+runs="${4:-5}"
+benchgit="$(realpath "$(dirname "$0")/benchgit")"
+
+dir="$(mktemp -d)"
+trap 'rm -rf "$dir"' EXIT
+export HOME="$dir/home"
+mkdir -p "$HOME/.cache" "$dir/src"
+
+# commit 0 writes every file, the later ones rewrite a different slice each time
+commit(){
+  awk -v files="$files" -v commits="$commits" -v size="$size" -v n="$1" -v dir="$dir/src" 'BEGIN{
+    for(i = 0; i < files; i++){
+      if(n > 0 && i % commits != n % commits)continue;
+      f = sprintf("%s/d%02d/f%05d.txt", dir, i % 32, i);
+      for(bytes = 0; bytes < size; bytes += length(line) + 1){
+        line = sprintf("file %d, line %d, version %d", i, bytes, n);
+        print line > f;
+      }
+      close(f);
+    }
+  }'
+  git -C "$dir/src" add -A
+  git -C "$dir/src" -c user.name=bench -c user.email=bench@localhost commit -q -m "commit $1"
+}
+
+git init -q -b master "$dir/src"
+for d in $(seq 0 31); do mkdir -p "$dir/src/$(printf "d%02d" "$d")"; done
+for n in $(seq 0 "$commits"); do commit "$n"; done
+git clone -q --bare "$dir/src" "$dir/remote.git"
+git -C "$dir/remote.git" config uploadpack.allowFilter true
+git -C "$dir/remote.git" config uploadpack.allowAnySHA1InWant true
+echo "$files files of $size bytes, $commits commits, $(du -sh "$dir/remote.git" | cut -f1) on the remote" >&2
+
+run(){
+  if ! "$benchgit" "$1" "$dir/remote.git" 'd*/*.txt' 2>"$dir/log" >>"$dir/times"; then
+    cat "$dir/log" >&2
+    exit 1
+  fi
+}
+
+for i in $(seq "$runs"); do
+  rm -rf "$HOME/.cache/sprinkler"
+  run cold
+  run no-change
+  commit "$((commits + i))"
+  git -C "$dir/src" push -q "$dir/remote.git" master
+  run warm
+done
+
+# syscalls are the read()s and write()s of benchgit itself in the median run, pkt writes are the ones that sent protocol lines
+sort -k1,1 -k2,2n "$dir/times" | awk -F '\t' '
+  { times[$1] = times[$1] " " $2; syscalls[$1] = syscalls[$1] " " $4; writes[$1] = writes[$1] " " $5; count[$1]++ }
+  END{
+    for(label in times){
+      split(substr(times[label], 2), t, " ");
+      split(substr(syscalls[label], 2), s, " ");
+      split(substr(writes[label], 2), w, " ");
+      m = int((count[label]+1)/2);
+      printf "%-10s min %5dms  median %5dms  max %5dms  %6d syscalls  %3d pkt writes\n", label, t[1], t[m], t[count[label]], s[m], w[m];
+    }
+  }'
@@ -0,0 +1,40 @@
+// times a single pullObjectCollection() call and counts its syscalls, see bench.sh
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGRAM_NAME "benchgit"
+#include "util.h"
+#include "git.h"
+
+#pragma comment(dir, "https://github.com/nothings/stb")
+#define STB_DS_IMPLEMENTATION
+#include <stb_ds.h>
+
+long countSyscalls(){
+  // read and write syscalls of this process so far, children like ssh aren't counted
+  FILE* f = fopen("/proc/self/io", "r");
+  if(f == NULL)return 0;
+  long res = 0;
+  char line[64];
+  while(fgets(line, sizeof(line), f)){
+    if(strncmp(line, "syscr: ", 7) == 0 || strncmp(line, "syscw: ", 7) == 0)res += atol(line+7);
+  }
+  fclose(f);
+  return res;
+}
+
+int main(int argc, char** argv){
+  if(argc < 4){
+    fprintf(stderr, "Usage: %s LABEL URL PATH...\n", argv[0]);
+    return 1;
+  }
+
+  long syscalls = countSyscalls();
+  long start = timems();
+  bool changed = pullObjectCollection(argv[2], argv+3, argc-3, sizeof(char*));
+  long ms = timems() - start;
+  syscalls = countSyscalls() - syscalls;
+  printf("%s\t%ld\t%s\t%ld\t%zu\n", argv[1], ms, changed ? "changed" : "unchanged", syscalls, pkt_write_calls);
+  return 0;
+}
@@ -1,11 +1,20 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -17,13 +26,19 @@
 #pragma comment(lib, "z")
 #include <zlib.h>
 
+#pragma comment(lib, "crypto")
+#include <openssl/sha.h>
+
 #define FPRINTF_REPO_INFO(goc) fprintf(stderr, \
   "\u2570\u2500\u2500"INFO"in repository %s:\x1b[32m%s\x1b[0m[%s]\n", (goc)->domain, (goc)->name, (goc)->branch);
 
-#define SSH_PERSIST "1m"
+#pragma comment(lib, "pthread")
+
 #define SSH_TIMEOUT_ARGS "-o", "BatchMode=yes", "-o", "ConnectTimeout=5s", "-o", "ServerAliveInterval=5s"
-#define SSH_MASTER_ARGS "-o", "ControlPersist="SSH_PERSIST, "-o", "ControlMaster=auto", SSH_TIMEOUT_ARGS
+#define SSH_MASTER_ARGS "-o", "ControlMaster=auto", SSH_TIMEOUT_ARGS
 #define GIT_HASH_LEN 40
+// arrsetlen(a, 0) without the always-false capacity check, keeps the allocation
+#define arrclear(a) do{ if(a)stbds_header(a)->length = 0; }while(0)
 
 typedef struct Process {
   pid_t pid;
@@ -40,11 +55,34 @@ typedef struct GitPackHeader {
   uint32_t entries;
 } GitPackHeader;
 
-#define DEFLATE_BUFFER_SIZE 4096
+#define ARENA_BLOCK_SIZE (1 << 20)
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t size;
+  size_t used;
+  uint8_t data[];
+} ArenaBlock;
+
+typedef struct Arena {
+  ArenaBlock* head;
+  size_t allocations;
+  size_t bytes;
+  size_t blocks;
+} Arena;
+
+#define LARGE_PACKET_MAX 65520
+#define PACK_THREADS_MIN_ENTRIES 256
+#define HAVE_FIRST_ROUND 2 // the commit we had and the one before, usually enough
+#define HAVE_COMMITS_MAX 16
+#define PIPE_BUFFER_SIZE (1 << 16)
+#define DEFLATE_BUFFER_SIZE (1 << 16)
 typedef struct DeflateBuffer {
   FILE* file;
+  bool sideband; // protocol v2 wraps the pack in pkt-lines
+  z_stream zlib; // reused for every entry of the pack
   size_t offset;
   size_t size;
+  uintmax_t position; // bytes consumed since the start of the pack
   uint8_t buff[DEFLATE_BUFFER_SIZE];
 } DeflateBuffer;
 
@@ -60,32 +98,145 @@ enum GitObjectType {
   OBJ_REF_DELTA = 7,
 };
 
+typedef struct PackEntry {
+  enum GitObjectType type;
+  uint8_t* data;
+  size_t length;
+  uintmax_t pack_offset;
+  char key[GIT_HASH_LEN+1]; // for objects, filled in by whoever hashes them
+  union {
+    uint8_t ref_hash[GIT_HASH_LEN/2];
+    uintmax_t offset; // absolute pack offset of the base
+  };
+} PackEntry;
+
+typedef struct PackHasher {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  PackEntry* entries;
+  size_t produced;
+  size_t next;
+  bool done;
+} PackHasher;
+
 typedef struct GitObject {
   char* key;
   uint8_t* data;
   size_t length;
   enum GitObjectType type;
+  bool is_saved; // it's in the .goc file already
 } GitObject;
 
 typedef struct GitDelta {
   enum GitObjectType type;
-  bool resolved;
   uint8_t* data;
   size_t length;
+  uintmax_t pack_offset;
   union {
     uint8_t ref_hash[GIT_HASH_LEN/2];
-    uintmax_t offset;
+    uintmax_t offset; // absolute pack offset of the base
   };
 } GitDelta;
 
+typedef struct PackOffset {
+  uintmax_t key;
+  char value[GIT_HASH_LEN+1];
+} PackOffset;
+
+typedef struct HaveCommit {
+  char hash[GIT_HASH_LEN+1];
+  char tree[GIT_HASH_LEN+1];
+  long time; // of the committer
+} HaveCommit;
+
 typedef struct WantedObject {
   char* hash;
   char* path;
   bool is_needed;
+  bool is_executable;
+  bool is_changed; // by the last commit, so the checkout may not be current
+  bool is_fetched; // already came in a thin pack, which doesn't have everything
+  bool is_oversized; // bigger than max_size, so it was skipped
+  size_t max_size; // 0 means no limit
 } WantedObject;
 
+// the .goc cache: a header with the repo info, the raw object data,
+// then a git-idx-like fanout table, the sorted binary hashes and an offset table
+#define GOC_SIGNATURE 0x21434f47 // "GOC!"
+#define GOC_FOOTER_SIGNATURE 0x2e434f47 // "GOC."
+#define GOC_VERSION 4
+#define GOC_SEGMENTS_MAX 16 // one more save than this and the file gets compacted
+#define GOC_COMPACT_SLACK (1 << 20) // appended bytes we put up with, even if they outweigh the compacted file
+typedef struct TreeEntry {
+  char* name;
+  uint8_t* hash;
+  uint32_t mode;
+  struct DecodedTree* subtree; // decoded the first time someone walks into it
+} TreeEntry;
+
+typedef struct DecodedTree {
+  TreeEntry* entries; // sorted by name
+  size_t count;
+} DecodedTree;
+
+typedef struct ChangedPath {
+  char* key;
+  TreeEntry* value; // in the new tree, NULL if the file was deleted
+} ChangedPath;
+
+typedef struct GocHeader {
+  uint32_t signature;
+  uint32_t version;
+  uint64_t footer_offset; // of the newest segment, the only part of the file that's ever written in place
+} GocHeader;
+
+typedef struct GocFooter {
+  uint32_t signature;
+  uint32_t segments; // counting this one
+  char last_commit[GIT_HASH_LEN+1];
+  uint64_t entries;
+  uint64_t fanout_offset;
+  uint64_t hashes_offset;
+  uint64_t table_offset;
+  uint64_t prev_offset; // footer of the segment before this one, 0 for the first
+} GocFooter;
+
+typedef struct GocEntry {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t type;
+  uint32_t flags;
+} GocEntry;
+
+#define GOC_ENTRY_EXTERNAL 1 // the data is a path in the tree, where the blob is checked out
+#define GOC_ENTRY_DELETED 2 // hides the entries for this object in older segments
+
+typedef struct GocSegment {
+  size_t entries;
+  const uint32_t* fanout;
+  const uint8_t* hashes;
+  const GocEntry* table;
+} GocSegment;
+
+typedef struct StringMap {
+  char* key;
+  char* value;
+} StringMap;
+
+typedef struct SizeMap {
+  char* key;
+  size_t value;
+} SizeMap;
+
+typedef enum GitTransport {
+  TRANSPORT_SSH,
+  TRANSPORT_LOCAL, // a path or a file:// url, served by running git-upload-pack ourselves
+} GitTransport;
+
 typedef struct GitObjectCollection {
   char last_commit[GIT_HASH_LEN+1];
+  char prev_commit[GIT_HASH_LEN+1]; // what last_commit was before this update, if it changed
+  GitTransport transport; // comes from the url every time, so it isn't saved
   char* domain;
   char* name;
   char* branch;
@@ -94,16 +245,61 @@ typedef struct GitObjectCollection {
   char* treepath;
   GitObject* hashmap;
   GitDelta* delta_list;
+  PackOffset* offset_map; // only valid for the most recently read pack
   WantedObject* want_list;
+  DecodedTree* root_tree; // of last_commit
+  ChangedPath* changed; // files that differ between prev_commit and last_commit
+  bool is_diffed; // otherwise we don't know what changed, so everything might have
+  bool is_thin; // the pack being read can have deltas against objects we don't hold
+  bool tracks_all; // a full clone, so every blob of last_commit is kept
+  Arena arena; // owns the data of every object that isn't in the mapping
+  StringMap* external; // hash -> path, for big blobs that only exist as their checkout
+  MmapedFile* blob_files; // the mappings of those checkouts
+  SizeMap* oversized; // hash -> length, of blobs we skipped, so a resident goc doesn't download them again
+
+  MmapedFile cache; // objects from the .goc file are served straight from this mapping
+  GocSegment* cache_segments; // newest first
+  uint64_t cache_footer; // offset of the newest one
 } GitObjectCollection;
 
-pid_t execFilePipe(char* name, char** arr, int pipes[2]){
+typedef struct PktSegment {
+  const char* data; // NULL if the bytes are in the writer's buffer
+  size_t offset;
+  size_t len;
+} PktSegment;
+
+typedef struct PktWriter {
+  // pkt-lines are queued up and sent with one writev() per block, instead of a write() each
+  int fd;
+  char* buff; // the headers and formatted lines, reused for every block
+  PktSegment* segments;
+} PktWriter;
+
+typedef struct GitSession {
+  Process process;
+  PktWriter writer;
+  int version; // 2 if the server understood GIT_PROTOCOL, 0 otherwise
+  bool is_open; // a v0 session ends with the first pack it sends
+  bool has_object_info; // so we can ask for blob sizes before wanting them
+  long handshake_ms;
+  char head[GIT_HASH_LEN+1]; // where the branch was when the session was opened
+} GitSession;
+
+int pack_threads = 0; // 0 means one per core
+int parallel_pulls = 1; // repos that are pulled at the same time, they split the pack_threads between them
+_Atomic size_t pkt_write_calls = 0; // for benchgit, the repo threads all add to it
+size_t stream_blob_size = 1 << 20; // bigger blobs get inflated straight into the tree
+char* ssh_persist = "1m"; // how long the ssh master outlives its last session
+size_t max_blob_size = 0; // for wants without a limit of their own, 0 means none
+int keep_commits = HAVE_FIRST_ROUND; // how many of our newest commits survive a save, 0 means all objects do
+
+pid_t execFilePipe(char* name, char** arr, char** env, int pipes[2]){
   pid_t pid = fork();
   arr[0] = name;
 
   if(pid == -1){
     perror("fork");
-    exit(1);
+    failPull();
   }else if(pid > 0){
     return pid;
   }else{
@@ -112,27 +308,28 @@ pid_t execFilePipe(char* name, char** arr, int pipes[2]){
     close(pipes[0]);
     close(pipes[1]);
 
-    execvp(name, arr);
+    if(env)execvpe(name, arr, env);
+    else execvp(name, arr);
     perror("execvp");
     fprintf(stderr, ERROR"can't run %s\n", name);
     exit(1);
   }
 }
 
-Process doublePopen(char* name, char** arr){
+Process doublePopen(char* name, char** arr, char** env){
+  // other threads might be forking too, so none of these should leak into their children
   int input_pipe[2];
   int output_pipe[2];
-  pipe(input_pipe);
-  pipe(output_pipe);
+  pipe2(input_pipe, O_CLOEXEC);
+  pipe2(output_pipe, O_CLOEXEC);
 
   Process res;
   res.name = name;
-  res.pid = execFilePipe(name, arr, (int[]){input_pipe[0], output_pipe[1]});
+  res.pid = execFilePipe(name, arr, env, (int[]){input_pipe[0], output_pipe[1]});
   res.input_pipe = fdopen(input_pipe[1], "w");
   res.output_pipe = fdopen(output_pipe[0], "r");
 
-  setvbuf(res.input_pipe, NULL, _IOLBF, 0);
-  setvbuf(res.output_pipe, NULL, _IOLBF, 0);
+  setvbuf(res.output_pipe, NULL, _IOFBF, PIPE_BUFFER_SIZE);
 
   close(input_pipe[0]);
   close(output_pipe[1]);
@@ -145,162 +342,705 @@ void closeProcess(Process* process){
 
   int status;
   waitpid(process->pid, &status, 0);
+  process->pid = 0;
   if(status){
     fprintf(stderr, ERROR"%s exited with code %d\n", process->name, WEXITSTATUS(status));
-    exit(1);
+    failPull();
   }
 }
 
-char* readPktLine(FILE* f){
+void* Arena_alloc(Arena* a, size_t size){
+  size_t aligned = (size + 15) & ~(size_t)15;
+  a->allocations++;
+  a->bytes += size;
+
+  if(a->head == NULL || a->head->size - a->head->used < aligned){
+    size_t block_size = aligned > ARENA_BLOCK_SIZE/4 ? aligned : ARENA_BLOCK_SIZE;
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + block_size + 15);
+    if(block == NULL){
+      fprintf(stderr, ERROR"can't allocate %zu bytes: %m\n", block_size);
+      failPull();
+    }
+    block->size = block_size;
+    block->used = (-(uintptr_t)block->data) & 15;
+    block->size += block->used;
+    a->blocks++;
+
+    if(a->head && block_size != ARENA_BLOCK_SIZE){
+      // big objects get a block of their own behind the current one, so its free space isn't lost
+      block->next = a->head->next;
+      a->head->next = block;
+      block->used += aligned;
+      return block->data + block->used - aligned;
+    }
+    block->next = a->head;
+    a->head = block;
+  }
+
+  void* res = a->head->data + a->head->used;
+  a->head->used += aligned;
+  return res;
+}
+
+void Arena_undo(Arena* a, void* ptr, size_t size){
+  // gives back the most recent allocation, if nothing else was allocated since
+  size_t aligned = (size + 15) & ~(size_t)15;
+  if(a->head && a->head->used >= aligned && (uint8_t*)ptr == a->head->data + a->head->used - aligned){
+    a->head->used -= aligned;
+    a->allocations--;
+    a->bytes -= size;
+  }
+}
+
+void Arena_reset(Arena* a){
+  // like Arena_release(), but keeps one ordinary block, for arenas that get emptied after every object
+  ArenaBlock* keep = NULL;
+  while(a->head){
+    ArenaBlock* next = a->head->next;
+    if(keep == NULL && a->head->size >= ARENA_BLOCK_SIZE && a->head->size < ARENA_BLOCK_SIZE+16){
+      keep = a->head;
+      keep->next = NULL;
+      keep->used = (-(uintptr_t)keep->data) & 15;
+    }else{
+      free(a->head);
+    }
+    a->head = next;
+  }
+  a->head = keep;
+}
+
+void Arena_release(Arena* a){
+  // the counters survive, so they can be reported later
+  while(a->head){
+    ArenaBlock* next = a->head->next;
+    free(a->head);
+    a->head = next;
+  }
+}
+
+int readPkt(FILE* f, char** payload){
+  // returns the length from the pkt-line header, so 0 is a flush-pkt, 1 is a delim-pkt and -1 is an error
+  // the payload is only valid until the next call
+  static _Thread_local char res[LARGE_PACKET_MAX+1];
   char length[5] = {0};
+  *payload = NULL;
   if(fread(length, 1, 4, f) != 4){
     fprintf(stderr, ERROR"EOF encountered while reading protocol lines: %m\n");
-    return NULL;
+    return -1;
   }
   int len = strtol(length, NULL, 16);
-  if(len <= 4)return NULL;
+  if(len <= 4)return len;
+  if(len > LARGE_PACKET_MAX){
+    fprintf(stderr, ERROR"protocol line is too long (%d bytes)\n", len);
+    return -1;
+  }
 
-  // todo: free!! and catch fread errors
-  char* res = malloc(len+1);
-  fread(res, 1, len-4, f);
+  if(fread(res, 1, len-4, f) != len-4){
+    fprintf(stderr, ERROR"EOF encountered while reading protocol lines: %m\n");
+    return -1;
+  }
   res[len-4] = '\0';
+  *payload = res;
+  return len;
+}
+
+char* readPktLine(FILE* f){
+  // the result is only valid until the next call
+  char* res;
+  int len = readPkt(f, &res);
+  if(res == NULL)return NULL;
   if(res[len-5] == '\n')res[len-5] = '\0';
   return res;
 }
 
-void readPktLinesUntil(FILE* f, const char* filter){
-  char* line;
-  while((line = readPktLine(f))){
-    bool res = filter && strcmp(line, filter) == 0;
-    free(line);
-    if(res)return;
+size_t readSidebandPkt(FILE* f, uint8_t* buff){
+  // returns the number of pack bytes written to buff, 0 once the flush-pkt arrives
+  char* payload;
+  int len;
+  while((len = readPkt(f, &payload)) > 4){
+    if(payload[0] == 1){
+      memcpy(buff, payload+1, len-5);
+      return len-5;
+    }else if(payload[0] == 3){
+      fprintf(stderr, ERROR"remote: %s", payload+1);
+      failPull();
+    }
   }
+  return 0;
 }
 
-char* selectGitBranch(FILE* f, const char* filter){
-  static char res[GIT_HASH_LEN+1];
+void readPktLinesUntil(FILE* f, const char* filter){
   char* line;
   while((line = readPktLine(f))){
-    if(strstr(line, filter))memcpy(res, line, GIT_HASH_LEN);
-    free(line);
+    if(filter && strcmp(line, filter) == 0)return;
   }
+}
 
-  res[GIT_HASH_LEN] = '\0';
+char* selectGitBranch(FILE* f, const char* ref, char* first_line){
+  // first_line is for when the caller had to look at the start of the advertisement already
+  static _Thread_local char res[GIT_HASH_LEN+1];
+  memset(res, 0, sizeof(res));
+  size_t ref_len = strlen(ref);
+  for(char* line = first_line ?: readPktLine(f); line; line = readPktLine(f)){
+    // "<hash> <ref>", followed by the capabilities after a '\0' in v0, or attributes after a ' ' in v2
+    if(strlen(line) <= GIT_HASH_LEN || line[GIT_HASH_LEN] != ' ')continue;
+    char* name = line + GIT_HASH_LEN + 1;
+    if(strncmp(name, ref, ref_len) == 0 && (name[ref_len] == '\0' || name[ref_len] == ' ')){
+      memcpy(res, line, GIT_HASH_LEN);
+    }
+  }
   return res;
 }
 
-void sendPktLine(FILE* f, const char* data){
+void PktWriter_push(PktWriter* pw, const char* data, size_t len){
+  // data has to stay valid until the block is sent, NULL means the last len bytes of the buffer
+  size_t count = arrlenu(pw->segments);
+  PktSegment* last = count ? &pw->segments[count-1] : NULL;
+  if(data == NULL && last && last->data == NULL){
+    last->len += len;
+    return;
+  }
+  arrput(pw->segments, ((PktSegment){data, data ? 0 : arrlenu(pw->buff) - len, len}));
+}
+
+void PktWriter_flush(PktWriter* pw){
+  struct iovec iov[IOV_MAX];
+  size_t count = arrlenu(pw->segments);
+  for(size_t i = 0; i < count;){
+    int iovcnt = 0;
+    size_t total = 0;
+    for(; i < count && iovcnt < IOV_MAX; i++, iovcnt++){
+      PktSegment* seg = &pw->segments[i];
+      iov[iovcnt] = (struct iovec){(void*)(seg->data ?: pw->buff + seg->offset), seg->len};
+      total += seg->len;
+    }
+
+    struct iovec* next = iov;
+    while(total){
+      ssize_t written = writev(pw->fd, next, iovcnt);
+      pkt_write_calls++;
+      if(written < 0){
+        if(errno == EINTR)continue;
+        fprintf(stderr, ERROR"can't write protocol lines: %m\n");
+        failPull();
+      }
+      total -= written;
+      // a pipe can take less than everything, so skip what did get written
+      while(iovcnt && (size_t)written >= next->iov_len){
+        written -= next->iov_len;
+        next++;
+        iovcnt--;
+      }
+      if(iovcnt){
+        next->iov_base = (char*)next->iov_base + written;
+        next->iov_len -= written;
+      }
+    }
+  }
+  arrclear(pw->buff);
+  arrclear(pw->segments);
+}
+
+void PktWriter_free(PktWriter* pw){
+  arrfree(pw->buff);
+  arrfree(pw->segments);
+}
+
+void sendPktLine(PktWriter* pw, const char* data){
+  // a flush-pkt ends a block, so that's when everything gets sent
   if(data == NULL || *data == '\0'){
-    fputs("0000", f);
-    fflush(f);
+    memcpy(arraddnptr(pw->buff, 4), "0000", 4);
+    PktWriter_push(pw, NULL, 4);
+    PktWriter_flush(pw);
     return;
   }
 
   size_t len = strlen(data);
-  fprintf(f, "%04x", (uint16_t)(len+4));
-  fwrite(data, 1, len, f);
+  snprintf(arraddnptr(pw->buff, 5), 5, "%04x", (uint16_t)(len+4));
+  arrsetlen(pw->buff, arrlen(pw->buff)-1);
+  PktWriter_push(pw, NULL, 4);
+  PktWriter_push(pw, data, len);
 }
 
-void printfPktLine(FILE* f, const char* format, const char* hash){
+void sendDelimPkt(PktWriter* pw){
+  memcpy(arraddnptr(pw->buff, 4), "0001", 4);
+  PktWriter_push(pw, NULL, 4);
+}
+
+void printfPktLine(PktWriter* pw, const char* format, const char* hash){
   size_t len = strlen(format) + strlen(hash) - 2;
-  fprintf(f, "%04x", (uint16_t)(len+4));
-  fprintf(f, format, hash);
+  snprintf(arraddnptr(pw->buff, len+5), len+5, "%04x", (uint16_t)(len+4));
+  snprintf(pw->buff + arrlen(pw->buff) - len-1, len+1, format, hash);
+  arrsetlen(pw->buff, arrlen(pw->buff)-1);
+  PktWriter_push(pw, NULL, len+4);
 }
 
-uint8_t DeflateBuffer_getc(DeflateBuffer* dfb){
+void DeflateBuffer_fill(DeflateBuffer* dfb){
+  dfb->offset = 0;
+  if(dfb->sideband)dfb->size = readSidebandPkt(dfb->file, dfb->buff);
+  else dfb->size = fread(dfb->buff, 1, DEFLATE_BUFFER_SIZE, dfb->file);
   if(dfb->size == 0){
-    int res = fgetc(dfb->file);
-    if(res < 0){
-      fprintf(stderr, ERROR"DeflateBuffer: no more bytes available: %m\n");
-      exit(1);
-    }
-    return res;
+    fprintf(stderr, ERROR"DeflateBuffer: no more bytes available: %m\n");
+    failPull();
   }
+}
+
+uint8_t DeflateBuffer_getc(DeflateBuffer* dfb){
+  if(dfb->size == 0)DeflateBuffer_fill(dfb);
 
   uint8_t res = dfb->buff[dfb->offset];
   dfb->offset++;
   dfb->size--;
+  dfb->position++;
   return res;
 }
 
-void DeflateBuffer_run(DeflateBuffer* dfb, uint8_t* mem, size_t size){
-  z_stream zlib = {0};
-  zlib.avail_out = size;
-  zlib.next_out = mem;
+void DeflateBuffer_run(DeflateBuffer* dfb, uint8_t* mem, size_t size, SHA_CTX* sha1context){
+  // inflates exactly one zlib stream into mem, hashing the output as it goes if sha1context is set
+  z_stream* zlib = &dfb->zlib;
+  inflateReset(zlib);
+  zlib->avail_out = size;
+  zlib->next_out = mem;
+
+  while(true){
+    if(dfb->size == 0)DeflateBuffer_fill(dfb);
+    zlib->avail_in = dfb->size;
+    zlib->next_in = dfb->buff + dfb->offset;
+    uint8_t* out_start = zlib->next_out;
+
+    int ret = inflate(zlib, Z_NO_FLUSH);
+    size_t consumed = dfb->size - zlib->avail_in;
+    dfb->offset += consumed;
+    dfb->size -= consumed;
+    dfb->position += consumed;
+    if(sha1context)SHA1_Update(sha1context, out_start, zlib->next_out - out_start);
+
+    if(ret == Z_STREAM_END)break;
+    if(ret == Z_BUF_ERROR && dfb->size == 0)continue;
+    if(ret != Z_OK){
+      fprintf(stderr, ERROR"zlib error: %s\n", zlib->msg ?: "object is longer than its header says");
+      failPull();
+    }
+  }
+
+  if(zlib->avail_out){
+    fprintf(stderr, ERROR"zlib error: object is shorter than its header says\n");
+    failPull();
+  }
+}
+
+void DeflateBuffer_runToFile(DeflateBuffer* dfb, FILE* out, size_t size, SHA_CTX* sha1context){
+  // same as DeflateBuffer_run(), but the output only passes through a small buffer on its way to the file
+  uint8_t chunk[DEFLATE_BUFFER_SIZE];
+  z_stream* zlib = &dfb->zlib;
+  inflateReset(zlib);
+  size_t left = size;
+
+  while(true){
+    if(dfb->size == 0)DeflateBuffer_fill(dfb);
+    zlib->avail_in = dfb->size;
+    zlib->next_in = dfb->buff + dfb->offset;
+    zlib->avail_out = sizeof(chunk);
+    zlib->next_out = chunk;
+
+    int ret = inflate(zlib, Z_NO_FLUSH);
+    size_t consumed = dfb->size - zlib->avail_in;
+    size_t produced = zlib->next_out - chunk;
+    dfb->offset += consumed;
+    dfb->size -= consumed;
+    dfb->position += consumed;
+    if(produced > left){
+      fprintf(stderr, ERROR"zlib error: object is longer than its header says\n");
+      failPull();
+    }
+    left -= produced;
+    if(sha1context)SHA1_Update(sha1context, chunk, produced);
+    if(fwrite(chunk, 1, produced, out) != produced){
+      fprintf(stderr, ERROR"can't write an inflated blob: %m\n");
+      failPull();
+    }
+
+    if(ret == Z_STREAM_END)break;
+    if(ret == Z_BUF_ERROR && dfb->size == 0)continue;
+    if(ret != Z_OK){
+      fprintf(stderr, ERROR"zlib error: %s\n", zlib->msg ?: "unknown error");
+      failPull();
+    }
+  }
+
+  if(left){
+    fprintf(stderr, ERROR"zlib error: object is shorter than its header says\n");
+    failPull();
+  }
+}
+
+void GitHash_init(SHA_CTX* sha1context, enum GitObjectType type, size_t length){
+  // same as hexsha1git(), but lets the data arrive in pieces
+  char buff[32];
+  int len = snprintf(buff, sizeof(buff), "%s %zu", git_object_names[type], length);
+  SHA1_Init(sha1context);
+  SHA1_Update(sha1context, buff, len+1);
+}
+
+void GitHash_final(SHA_CTX* sha1context, char* hex){
+  // writes straight into the caller's buffer, since the hashing threads fill in PackEntry.key
+  static const char digits[] = "0123456789abcdef";
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  SHA1_Final(hash, sha1context);
+  for(int i = 0; i < SHA_DIGEST_LENGTH; i++){
+    hex[i*2] = digits[hash[i] >> 4];
+    hex[i*2+1] = digits[hash[i] & 0xf];
+  }
+  hex[GIT_HASH_LEN] = '\0';
+}
+
+void PackHasher_finish(PackHasher* ph, pthread_t* threads){
+  pthread_mutex_lock(&ph->lock);
+  ph->done = true;
+  pthread_cond_broadcast(&ph->cond);
+  pthread_mutex_unlock(&ph->lock);
+  for(int i = 0; i < arrlen(threads); i++){
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&ph->lock);
+  pthread_cond_destroy(&ph->cond);
+  arrfree(threads);
+}
 
-  size_t prev_total = 0;
-  inflateInit(&zlib);
+void* PackHasher_worker(void* arg){
+  PackHasher* ph = arg;
+  pthread_mutex_lock(&ph->lock);
   while(true){
-    if(dfb->size == 0){
-      dfb->size = fread(dfb->buff, 1, DEFLATE_BUFFER_SIZE, dfb->file);
-      dfb->offset = 0;
+    while(ph->next == ph->produced && !ph->done){
+      pthread_cond_wait(&ph->cond, &ph->lock);
     }
-    zlib.avail_in = dfb->size;
-    zlib.next_in = dfb->buff + dfb->offset;
-    inflate(&zlib, Z_NO_FLUSH);
-    if(zlib.msg){
-      fprintf(stderr, ERROR"zlib error: %s\n", zlib.msg);
-      exit(1);
+    if(ph->next == ph->produced)break;
+    PackEntry* e = &ph->entries[ph->next++];
+    pthread_mutex_unlock(&ph->lock);
+
+    if(e->type < OBJ_OFS_DELTA && e->key[0] == '\0'){
+      SHA_CTX sha1context;
+      GitHash_init(&sha1context, e->type, e->length);
+      SHA1_Update(&sha1context, e->data, e->length);
+      GitHash_final(&sha1context, e->key);
     }
-    dfb->offset += zlib.total_in - prev_total;
-    dfb->size -= zlib.total_in - prev_total;
-    if(prev_total == zlib.total_in)break;
-    prev_total = zlib.total_in;
+
+    pthread_mutex_lock(&ph->lock);
   }
-  inflateEnd(&zlib);
+  pthread_mutex_unlock(&ph->lock);
+  return NULL;
 }
 
-void readPackFile(FILE* f, GitObjectCollection* res){
-  if(!res->hashmap)sh_new_arena(res->hashmap);
+uint8_t* mapBlobFile(GitObjectCollection* goc, const char* path, size_t length){
+  // NULL if the file is gone or has the wrong size, the mapping lives as long as goc
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0)return NULL;
+  struct stat st;
+  void* data = MAP_FAILED;
+  if(fstat(fd, &st) == 0 && st.st_size == length && length){
+    data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  if(data == MAP_FAILED){
+    close(fd);
+    return NULL;
+  }
+  MmapedFile tmp = {fd, data, length};
+  arrput(goc->blob_files, tmp);
+  return data;
+}
+
+GitObject* findExternalObject(GitObjectCollection* goc, const char* hash, const GocEntry* e){
+  const char* path = goc->cache.data + e->offset;
+  if(e->offset >= goc->cache.len || memchr(path, '\0', goc->cache.len - e->offset) == NULL){
+    fprintf(stderr, ERROR"corrupted entry for object %s in '%s'\n", hash, goc->filename);
+    return NULL;
+  }
+
+  // if somebody messed with the checkout, we'll just fetch the blob again
+  char* full_path = concatStrings((char*[]){goc->treepath, "/", (char*)path, NULL});
+  uint8_t* data = mapBlobFile(goc, full_path, e->length);
+  free(full_path);
+  if(data == NULL)return NULL;
+
+  StringMap ext = {(char*)hash, strdup(path)};
+  shputs(goc->external, ext);
+  GitObject tmp = {(char*)hash, data, e->length, OBJ_BLOB, true};
+  shputs(goc->hashmap, tmp);
+  return shgetp_null(goc->hashmap, hash);
+}
+
+const GocEntry* findCacheEntry(GitObjectCollection* goc, const uint8_t* bin){
+  // the newest segment that has the object wins
+  for(int i = 0; i < arrlen(goc->cache_segments); i++){
+    const GocSegment* seg = &goc->cache_segments[i];
+    size_t lo = bin[0] ? seg->fanout[bin[0]-1] : 0;
+    size_t hi = seg->fanout[bin[0]];
+    if(lo > hi || hi > seg->entries)continue;
+
+    while(lo < hi){
+      size_t mid = lo + (hi-lo)/2;
+      int cmp = memcmp(seg->hashes + mid*(GIT_HASH_LEN/2), bin, GIT_HASH_LEN/2);
+      if(cmp < 0)lo = mid+1;
+      else if(cmp > 0)hi = mid;
+      else return &seg->table[mid];
+    }
+  }
+  return NULL;
+}
 
+GitObject* findObject(GitObjectCollection* goc, const char* hash){
+  // objects from the .goc file only get a hashmap entry once somebody asks for them
+  GitObject* res = shgetp_null(goc->hashmap, hash);
+  if(res || arrlen(goc->cache_segments) == 0)return res;
+
+  uint8_t bin[GIT_HASH_LEN/2];
+  if(!hextosha1(hash, bin))return NULL;
+  const GocEntry* e = findCacheEntry(goc, bin);
+  if(e == NULL || e->flags & GOC_ENTRY_DELETED)return NULL;
+  if(e->flags & GOC_ENTRY_EXTERNAL)return findExternalObject(goc, hash, e);
+  if(e->offset > goc->cache.len || e->length > goc->cache.len - e->offset || e->type >= OBJ_OFS_DELTA){
+    fprintf(stderr, ERROR"corrupted entry for object %s in '%s'\n", hash, goc->filename);
+    return NULL;
+  }
+  GitObject tmp = {(char*)hash, (uint8_t*)goc->cache.data + e->offset, e->length, e->type, true};
+  shputs(goc->hashmap, tmp);
+  return shgetp_null(goc->hashmap, hash);
+}
+
+uint32_t readPackHeader(DeflateBuffer* buf){
   GitPackHeader hdr;
-  fread(&hdr, sizeof(GitPackHeader), 1, f);
+  for(size_t i = 0; i < sizeof(GitPackHeader); i++){
+    ((uint8_t*)&hdr)[i] = DeflateBuffer_getc(buf);
+  }
   assert(ntohl(hdr.signature) == PACK_SIGNATURE);
   assert(ntohl(hdr.version) == PACK_VERSION);
+  return ntohl(hdr.entries);
+}
+
+void readPackEntryHeader(DeflateBuffer* buf, PackEntry* e){
+  // everything up to the zlib stream: the type, the inflated length and the delta base
+  e->pack_offset = buf->position;
+  uint8_t byte = DeflateBuffer_getc(buf);
+  uintmax_t length = byte&0x0f;
+  e->type = (byte&0x70) >> 4;
+  for(int j = 4; byte&0x80; j += 7){
+    byte = DeflateBuffer_getc(buf);
+    length |= (uintmax_t)(byte&0x7f) << j;
+  }
+  e->length = length;
+
+  if(e->type == OBJ_REF_DELTA){
+    for(int j = 0; j < GIT_HASH_LEN/2; j++){
+      e->ref_hash[j] = DeflateBuffer_getc(buf);
+    }
+  }else if(e->type == OBJ_OFS_DELTA){
+    // see get_delta_base() in git's packfile.c: every continuation byte also adds one
+    byte = DeflateBuffer_getc(buf);
+    uintmax_t offset = byte&0x7f;
+    while(byte&0x80){
+      byte = DeflateBuffer_getc(buf);
+      offset = ((offset+1) << 7) | (byte&0x7f);
+    }
+    if(offset == 0 || offset > e->pack_offset){
+      fprintf(stderr, ERROR"invalid 'ofs_delta' base offset %ju at %ju\n", offset, e->pack_offset);
+      failPull();
+    }
+    e->offset = e->pack_offset - offset;
+  }else if(e->type == OBJ_NONE || e->type == 5){
+    fprintf(stderr, ERROR"invalid object type %d at pack offset %ju\n", e->type, e->pack_offset);
+    failPull();
+  }
+}
+
+bool isOversized(WantedObject* want, size_t length){
+  return want->max_size && length > want->max_size;
+}
+
+void skipOversizedBlob(GitObjectCollection* goc, WantedObject* want, size_t length){
+  fprintf(stderr, WARNING"skipping \x1b[32m%s\x1b[0m, it has %zu KiB, more than the limit of %zu KiB\n",
+    want->path[0] == '/' ? want->path+1 : want->path, length/1024, want->max_size/1024);
+  FPRINTF_REPO_INFO(goc);
+  want->is_needed = false;
+  want->is_oversized = true;
+  shput(goc->oversized, want->hash, length);
+}
+
+WantedObject* findWantByHash(GitObjectCollection* goc, const char* hash, size_t length){
+  // the first want this blob isn't too big for, the ones it is too big for get skipped on the way
+  for(int i = 0; i < arrlen(goc->want_list); i++){
+    WantedObject* want = &goc->want_list[i];
+    if(want->is_oversized || strcmp(want->hash, hash) != 0)continue;
+    if(!isOversized(want, length))return want;
+    skipOversizedBlob(goc, want, length);
+  }
+  return NULL;
+}
+
+char* inflateBlobToFile(GitObjectCollection* goc, DeflateBuffer* dfb, PackEntry* e){
+  // returns the name of a temporary file in the tree, e->key gets filled in
+  mkdir_safe(goc->treepath);
+  char* path = concatStrings((char*[]){goc->treepath, "/.inflate-XXXXXX", NULL});
+  int fd = mkostemp(path, O_CLOEXEC);
+  FILE* file = fd < 0 ? NULL : fdopen(fd, "wb");
+  if(file == NULL){
+    fprintf(stderr, ERROR"can't create file '%s': %m\n", path);
+    failPull();
+  }
+  // a pack that ends in the middle of the blob leaves nothing behind
+  jmp_buf on_error;
+  jmp_buf* outer_error = pull_error;
+  if(setjmp(on_error)){
+    pull_error = outer_error;
+    fclose(file);
+    unlink(path);
+    free(path);
+    failPull();
+  }
+  pull_error = &on_error;
+
+  SHA_CTX sha1context;
+  GitHash_init(&sha1context, e->type, e->length);
+  DeflateBuffer_runToFile(dfb, file, e->length, &sha1context);
+  GitHash_final(&sha1context, e->key);
+  pull_error = outer_error;
+  if(fclose(file) != 0){
+    fprintf(stderr, ERROR"failed to write file '%s': %m\n", path);
+    failPull();
+  }
+  return path;
+}
+
+uint8_t* placeStreamedBlob(GitObjectCollection* goc, char* tmp_path, PackEntry* e, WantedObject* want){
+  // a wanted blob becomes its own checkout, anything else stays readable until goc is gone
+  uint8_t* data;
+  if(want){
+    char* path = concatStrings((char*[]){goc->treepath, "/", want->path, NULL});
+    mkdir_parents(path);
+    chmod(tmp_path, want->is_executable ? 0755 : 0644);
+    if(rename(tmp_path, path) != 0){
+      fprintf(stderr, ERROR"can't move a blob to '%s': %m\n", path);
+      failPull();
+    }
+    data = mapBlobFile(goc, path, e->length);
+    free(path);
+
+    StringMap ext = {e->key, strdup(want->path)};
+    shputs(goc->external, ext);
+  }else{
+    data = mapBlobFile(goc, tmp_path, e->length);
+    unlink(tmp_path);
+  }
+
+  if(data == NULL){
+    fprintf(stderr, ERROR"can't map blob %s: %m\n", e->key);
+    failPull();
+  }
+  return data;
+}
+
+void readPackFile(FILE* f, bool sideband, GitObjectCollection* res){
+  if(!res->hashmap)sh_new_arena(res->hashmap);
+  hmfree(res->offset_map);
+
+  DeflateBuffer buf = {.file = f, .sideband = sideband};
+  uint32_t count = readPackHeader(&buf);
+  PackEntry* entries = calloc(count, sizeof(PackEntry));
+  if(entries == NULL && count){
+    fprintf(stderr, ERROR"can't allocate %u pack entries: %m\n", count);
+    failPull();
+  }
+
+  // this thread has to inflate everything, since that's the only way to find where an entry ends,
+  // but the hashing can happen elsewhere while we move on to the next entry
+  int thread_count = (pack_threads > 0 ? pack_threads : sysconf(_SC_NPROCESSORS_ONLN)) / parallel_pulls;
+  if(count < PACK_THREADS_MIN_ENTRIES)thread_count = 1;
+  PackHasher ph = {.entries = entries};
+  pthread_t* threads = NULL;
+  if(thread_count > 1){
+    pthread_mutex_init(&ph.lock, NULL);
+    pthread_cond_init(&ph.cond, NULL);
+    // we are one of the threads too, even though we don't hash
+    for(int i = 0; i < thread_count-1; i++){
+      pthread_t thread;
+      if(pthread_create(&thread, NULL, PackHasher_worker, &ph) == 0)arrput(threads, thread);
+    }
+  }
+
+  inflateInit(&buf.zlib);
+  // the hashers work on entries, so a failed pull has to stop them before it frees anything
+  jmp_buf on_error;
+  jmp_buf* outer_error = pull_error;
+  if(setjmp(on_error)){
+    pull_error = outer_error;
+    inflateEnd(&buf.zlib);
+    if(thread_count > 1)PackHasher_finish(&ph, threads);
+    for(uint32_t i = 0; i < count; i++){
+      if(entries[i].type >= OBJ_OFS_DELTA)free(entries[i].data);
+    }
+    free(entries);
+    failPull();
+  }
+  pull_error = &on_error;
 
-  DeflateBuffer buf = {.file = f};
-  uint32_t count = ntohl(hdr.entries);
   for(uint32_t i = 0; i < count; i++){
-    uint8_t byte = DeflateBuffer_getc(&buf);
-    uintmax_t length = byte&0x0f;
-    uint8_t type = (byte&0x70) >> 4;
-    for(int j = 4; byte&0x80; j += 7){
-      byte = DeflateBuffer_getc(&buf);
-      length |= (byte&0x7f) << j;
-    }
-
-    uint8_t git_hash[GIT_HASH_LEN/2];
-    uintmax_t offset = 0;
-    if(type == OBJ_REF_DELTA){
-      for(int j = 0; j < GIT_HASH_LEN/2; j++){
-        git_hash[j] = DeflateBuffer_getc(&buf);
-      }
-    }else if(type == OBJ_OFS_DELTA){
-      do{
-        byte = DeflateBuffer_getc(&buf);
-        offset <<= 7;
-        offset |= byte&0x7f;
-      }while(byte&0x80);
-    }
-
-    uint8_t* mem = malloc(length);
-    DeflateBuffer_run(&buf, mem, length);
-    if(type < OBJ_OFS_DELTA){
-      GitObject tmp = {.data = mem, .length = length, .type = type};
-      tmp.key = hexsha1git(git_object_names[type], mem, length);
-      GitObject* old = shgetp_null(res->hashmap, tmp.key);
-      if(old)free(old->data);
-      shputs(res->hashmap, tmp);
+    PackEntry* e = &entries[i];
+    readPackEntryHeader(&buf, e);
+    size_t length = e->length;
+    if(e->type == OBJ_BLOB && length >= stream_blob_size){
+      char* tmp_path = inflateBlobToFile(res, &buf, e);
+      e->data = placeStreamedBlob(res, tmp_path, e, findWantByHash(res, e->key, length));
+      free(tmp_path);
+    }else if(arrlen(threads) || e->type >= OBJ_OFS_DELTA){
+      // a delta is only needed until it's applied, so it gets its own malloc and is freed right after
+      e->data = e->type < OBJ_OFS_DELTA ? Arena_alloc(&res->arena, length) : malloc(length);
+      DeflateBuffer_run(&buf, e->data, length, NULL);
     }else{
-      GitDelta tmp = {.data = mem, .length = length, .type = type};
-      if(type == OBJ_OFS_DELTA)tmp.offset = offset;
-      else memcpy(tmp.ref_hash, git_hash, sizeof(git_hash));
+      e->data = Arena_alloc(&res->arena, length);
+      SHA_CTX sha1context;
+      GitHash_init(&sha1context, e->type, length);
+      DeflateBuffer_run(&buf, e->data, length, &sha1context);
+      GitHash_final(&sha1context, e->key);
+    }
+
+    if(arrlen(threads)){
+      pthread_mutex_lock(&ph.lock);
+      ph.produced = i+1;
+      pthread_cond_signal(&ph.cond);
+      pthread_mutex_unlock(&ph.lock);
+    }
+  }
+  inflateEnd(&buf.zlib);
+  // the trailing checksum and the end of the response are still in the pipe
+  if(sideband)while(readSidebandPkt(f, buf.buff));
+
+  pull_error = outer_error;
+  if(thread_count > 1)PackHasher_finish(&ph, threads);
+
+  // the object store isn't thread safe, so everything gets inserted here, in pack order
+  for(uint32_t i = 0; i < count; i++){
+    PackEntry* e = &entries[i];
+    if(e->type < OBJ_OFS_DELTA){
+      GitObject tmp = {.key = e->key, .data = e->data, .length = e->length, .type = e->type};
+      if(!findObject(res, tmp.key))shputs(res->hashmap, tmp);
+
+      PackOffset po = {.key = e->pack_offset};
+      memcpy(po.value, e->key, GIT_HASH_LEN);
+      hmputs(res->offset_map, po);
+    }else{
+      GitDelta tmp = {.data = e->data, .length = e->length, .type = e->type, .pack_offset = e->pack_offset};
+      if(e->type == OBJ_OFS_DELTA)tmp.offset = e->offset;
+      else memcpy(tmp.ref_hash, e->ref_hash, sizeof(tmp.ref_hash));
       arrput(res->delta_list, tmp);
     }
   }
+  free(entries);
 }
 
 void deleteObjectCollection(GitObjectCollection* goc){
+  if(verbose){
+    fprintf(stderr, INFO"%s: %zu objects (%zu KiB) in %zu mallocs\n", goc->name,
+      goc->arena.allocations, goc->arena.bytes/1024, goc->arena.blocks);
+  }
   free(goc->domain);
   free(goc->name);
   free(goc->branch);
@@ -308,14 +1048,23 @@ void deleteObjectCollection(GitObjectCollection* goc){
   free(goc->socket);
   free(goc->treepath);
 
-  for(int i = 0; i < arrlen(goc->delta_list); i++){
-    free(goc->delta_list[i].data);
-  }
-  for(int i = 0; i < shlen(goc->hashmap); i++){
-    free(goc->hashmap[i].data);
-  }
+  Arena_release(&goc->arena);
+  for(int i = 0; i < arrlen(goc->delta_list); i++)free(goc->delta_list[i].data);
   arrfree(goc->delta_list);
   shfree(goc->hashmap);
+  hmfree(goc->offset_map);
+  if(goc->cache.data)closeFile(goc->cache);
+  arrfree(goc->cache_segments);
+  for(int i = 0; i < shlen(goc->external); i++){
+    free(goc->external[i].value);
+  }
+  shfree(goc->external);
+  shfree(goc->oversized);
+  shfree(goc->changed);
+  for(int i = 0; i < arrlen(goc->blob_files); i++){
+    closeFile(goc->blob_files[i]);
+  }
+  arrfree(goc->blob_files);
 
   for(int i = 0; i < arrlen(goc->want_list); i++){
     free(goc->want_list[i].hash);
@@ -346,171 +1095,1236 @@ void printGitObject(GitObject* o){
   }
 }
 
-void resolveDeltas(GitObjectCollection* goc){
-  for(int i = 0; i < arrlen(goc->delta_list); i++){
-    GitDelta delta = goc->delta_list[i];
-    if(delta.resolved)continue;
+uintmax_t readDeltaSize(uint8_t** mem){
+  // a delta starts with two of these, the size of the base and the size of the result
+  uintmax_t res = 0;
+  for(int j = 0;; j += 7){
+    res |= (uintmax_t)(**mem&0x7f) << j;
+    if(!(*((*mem)++)&0x80))break;
+  }
+  return res;
+}
 
-    GitObject base;
-    if(delta.type == OBJ_REF_DELTA){
-      char* hash = sha1tohex(delta.ref_hash);
-      base = shgets(goc->hashmap, hash);
-    }else{
-      fprintf(stderr, ERROR"resoving '%s' delta is not implemented yet\n", git_object_names[delta.type]);
-      continue;
-    }
+uintmax_t deltaResultSize(GitDelta* delta){
+  uint8_t* mem = delta->data;
+  readDeltaSize(&mem);
+  return readDeltaSize(&mem);
+}
 
-    uint8_t* mem = delta.data;
-    uintmax_t basesize = 0;
-    uintmax_t newsize = 0;
-    for(int j = 0;; j += 7){
-      basesize |= (*mem&0x7f) << j;
-      if(!(*(mem++)&0x80))break;
-    }
-    for(int j = 0;; j += 7){
-      newsize |= (*mem&0x7f) << j;
-      if(!(*(mem++)&0x80))break;
-    }
-    assert(base.length == basesize);
-
-    GitObject res = base;
-    uint8_t* newmem = malloc(newsize);
-    res.data = newmem;
-    res.length = newsize;
-    for(; mem < delta.data + delta.length; mem++){
-      uint8_t byte = *mem;
-      if(byte&0x80){
-        uint32_t offset = 0;
-        uint32_t size = 0;
-        if(byte&0x01)offset |= (*++mem) << 0*8;
-        if(byte&0x02)offset |= (*++mem) << 1*8;
-        if(byte&0x04)offset |= (*++mem) << 2*8;
-        if(byte&0x08)offset |= (*++mem) << 3*8;
-        if(byte&0x10)size   |= (*++mem) << 0*8;
-        if(byte&0x20)size   |= (*++mem) << 1*8;
-        if(byte&0x40)size   |= (*++mem) << 2*8;
-        if(size == 0)size = 0x10000;
-
-        if(size > newsize)size = newsize;
-        memcpy(newmem, base.data + offset, size);
-        newmem += size;
-        newsize -= size;
-      }else{
-        if(byte > newsize)byte = newsize;
-        memcpy(newmem, mem+1, byte);
-        newmem += byte;
-        mem += byte;
-        newsize -= byte;
-      }
+void runDelta(uint8_t* newmem, uintmax_t newsize, GitObject* base, GitDelta* delta){
+  uint8_t* mem = delta->data;
+  uintmax_t basesize = readDeltaSize(&mem);
+  readDeltaSize(&mem);
+  assert(base->length == basesize);
+
+  for(; mem < delta->data + delta->length; mem++){
+    uint8_t byte = *mem;
+    if(byte&0x80){
+      uint32_t offset = 0;
+      uint32_t size = 0;
+      if(byte&0x01)offset |= (uint32_t)(*++mem) << 0*8;
+      if(byte&0x02)offset |= (uint32_t)(*++mem) << 1*8;
+      if(byte&0x04)offset |= (uint32_t)(*++mem) << 2*8;
+      if(byte&0x08)offset |= (uint32_t)(*++mem) << 3*8;
+      if(byte&0x10)size   |= (uint32_t)(*++mem) << 0*8;
+      if(byte&0x20)size   |= (uint32_t)(*++mem) << 1*8;
+      if(byte&0x40)size   |= (uint32_t)(*++mem) << 2*8;
+      if(size == 0)size = 0x10000;
+
+      if(size > newsize)size = newsize;
+      assert(offset + (uintmax_t)size <= base->length);
+      memcpy(newmem, base->data + offset, size);
+      newmem += size;
+      newsize -= size;
+    }else{
+      if(byte > newsize)byte = newsize;
+      memcpy(newmem, mem+1, byte);
+      newmem += byte;
+      mem += byte;
+      newsize -= byte;
     }
-
-    res.key = hexsha1git(git_object_names[res.type], res.data, res.length);
-    shputs(goc->hashmap, res);
-    delta.resolved = true;
   }
 }
 
-void writeSizedString(FILE* f, char* str){
-  size_t len = strlen(str);
-  fwrite(&len, sizeof(size_t), 1, f);
-  fwrite(str, 1, len, f);
+GitObject applyDelta(Arena* arena, GitObject* base, GitDelta* delta){
+  GitObject res = *base;
+  res.length = deltaResultSize(delta);
+  res.data = Arena_alloc(arena, res.length);
+  res.is_saved = false;
+  runDelta(res.data, res.length, base, delta);
+  res.key = hexsha1git(git_object_names[res.type], res.data, res.length);
+  return res;
 }
 
-bool readSizedString(FILE* f, char** str){
-  size_t len = SIZE_MAX;
-  if(fread(&len, sizeof(size_t), 1, f) != 1)return false;
-  if(len == SIZE_MAX)return false;
-  *str = calloc(len+1, 1);
-  if(*str == NULL)return false;
-  return fread(*str, 1, len, f) == len;
+char* applyDeltaToFile(GitObjectCollection* goc, GitObject* base, GitDelta* delta, PackEntry* e){
+  // like inflateBlobToFile(), for a blob that comes as a delta, the result is built in the page cache instead of the arena
+  e->length = deltaResultSize(delta);
+  mkdir_safe(goc->treepath);
+  char* path = concatStrings((char*[]){goc->treepath, "/.inflate-XXXXXX", NULL});
+  int fd = mkostemp(path, O_CLOEXEC);
+  uint8_t* data = MAP_FAILED;
+  if(fd >= 0 && ftruncate(fd, e->length) == 0){
+    data = mmap(NULL, e->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if(data == MAP_FAILED){
+    fprintf(stderr, ERROR"can't create file '%s': %m\n", path);
+    failPull();
+  }
+
+  runDelta(data, e->length, base, delta);
+  memcpy(e->key, hexsha1git("blob", data, e->length), sizeof(e->key));
+  munmap(data, e->length);
+  close(fd);
+  return path;
 }
 
-void saveObjectCollection(FILE* f, GitObjectCollection* goc){
-  fwrite(&goc->last_commit, sizeof(goc->last_commit), 1, f);
-  writeSizedString(f, goc->domain);
-  writeSizedString(f, goc->name);
-  writeSizedString(f, goc->branch);
-  writeSizedString(f, goc->socket);
+typedef struct DeltaRefChildren {
+  char* key;
+  int* value;
+} DeltaRefChildren;
+
+typedef struct DeltaOfsChildren {
+  uintmax_t key;
+  int* value;
+} DeltaOfsChildren;
+
+int resolveDeltas(GitObjectCollection* goc){
+  // returns how many deltas had no base, a thin pack can have those for objects we didn't want
+  // deltas whose base isn't known yet wait here until the base gets reconstructed
+  DeltaRefChildren* ref_children = NULL;
+  DeltaOfsChildren* ofs_children = NULL;
+  int* ready = NULL;
+  sh_new_strdup(ref_children);
 
-  size_t len = shlenu(goc->hashmap);
-  fwrite(&len, sizeof(size_t), 1, f);
-  for(int i = 0; i < shlen(goc->hashmap); i++){
-    fwrite(&goc->hashmap[i], sizeof(GitObject), 1, f);
-    fwrite(goc->hashmap[i].key, 1, GIT_HASH_LEN, f);
-    fwrite(goc->hashmap[i].data, 1, goc->hashmap[i].length, f);
+  for(int i = 0; i < arrlen(goc->delta_list); i++){
+    GitDelta* delta = &goc->delta_list[i];
+    if(delta->type == OBJ_REF_DELTA){
+      char* hash = sha1tohex(delta->ref_hash);
+      if(findObject(goc, hash)){
+        arrput(ready, i);
+      }else{
+        DeltaRefChildren* entry = shgetp_null(ref_children, hash);
+        if(entry == NULL){
+          shput(ref_children, hash, NULL);
+          entry = shgetp_null(ref_children, hash);
+        }
+        arrput(entry->value, i);
+      }
+    }else{
+      if(hmgetp_null(goc->offset_map, delta->offset)){
+        arrput(ready, i);
+      }else{
+        DeltaOfsChildren* entry = hmgetp_null(ofs_children, delta->offset);
+        if(entry == NULL){
+          hmput(ofs_children, delta->offset, NULL);
+          entry = hmgetp_null(ofs_children, delta->offset);
+        }
+        arrput(entry->value, i);
+      }
+    }
   }
-}
 
-bool loadObjectCollection(FILE* f, GitObjectCollection* goc){
-  size_t len = SIZE_MAX;
-  char hash[GIT_HASH_LEN+1] = {0};
+  // depth first, so a chain is walked while its freshly reconstructed base is still hot
+  int resolved = 0;
+  while(arrlen(ready)){
+    GitDelta* delta = &goc->delta_list[arrpop(ready)];
+
+    GitObject* base;
+    if(delta->type == OBJ_REF_DELTA){
+      base = findObject(goc, sha1tohex(delta->ref_hash));
+    }else{
+      base = findObject(goc, hmgetp_null(goc->offset_map, delta->offset)->value);
+    }
+    assert(base);
+
+    GitObject res;
+    PackEntry streamed = {.type = OBJ_BLOB};
+    uintmax_t length = deltaResultSize(delta);
+    bool is_streamed = base->type == OBJ_BLOB && length >= stream_blob_size && length;
+    if(is_streamed){
+      // a big blob that changed a little still gets written straight into its checkout
+      char* tmp_path = applyDeltaToFile(goc, base, delta, &streamed);
+      res = (GitObject){.key = streamed.key, .length = streamed.length, .type = OBJ_BLOB};
+      res.data = placeStreamedBlob(goc, tmp_path, &streamed, findWantByHash(goc, streamed.key, streamed.length));
+      free(tmp_path);
+    }else{
+      res = applyDelta(&goc->arena, base, delta);
+    }
+    free(delta->data);
+    delta->data = NULL;
+    resolved++;
 
-  fread(&goc->last_commit, sizeof(goc->last_commit), 1, f);
-  if(!readSizedString(f, &goc->domain))return false;
-  if(!readSizedString(f, &goc->name))return false;
-  if(!readSizedString(f, &goc->branch))return false;
-  if(!readSizedString(f, &goc->socket))return false;
+    if(findObject(goc, res.key)){
+      if(!is_streamed)Arena_undo(&goc->arena, res.data, res.length);
+    }else{
+      shputs(goc->hashmap, res);
+    }
 
-  fread(&len, sizeof(size_t), 1, f);
-  if(len >= UINT32_MAX)return false;
+    PackOffset po = {.key = delta->pack_offset};
+    memcpy(po.value, res.key, GIT_HASH_LEN);
+    hmputs(goc->offset_map, po);
 
-  goc->hashmap = NULL;
-  goc->delta_list = NULL;
-  sh_new_arena(goc->hashmap);
-  for(size_t i = 0; i < len; i++){
-    GitObject o;
-    fread(&o, sizeof(GitObject), 1, f);
-    fread(&hash, 1, GIT_HASH_LEN, f);
-    o.key = hash;
-    o.data = malloc(o.length);
-    if(o.data == NULL)return false;
-    fread(o.data, 1, o.length, f);
-    shputs(goc->hashmap, o);
+    DeltaRefChildren* ref_entry = shgetp_null(ref_children, po.value);
+    if(ref_entry){
+      for(int j = 0; j < arrlen(ref_entry->value); j++)arrput(ready, ref_entry->value[j]);
+      arrfree(ref_entry->value);
+    }
+    DeltaOfsChildren* ofs_entry = hmgetp_null(ofs_children, po.key);
+    if(ofs_entry){
+      for(int j = 0; j < arrlen(ofs_entry->value); j++)arrput(ready, ofs_entry->value[j]);
+      arrfree(ofs_entry->value);
+    }
   }
 
-  return true;
+  int dropped = (int)arrlen(goc->delta_list) - resolved;
+  for(int i = 0; i < arrlen(goc->delta_list); i++)free(goc->delta_list[i].data);
+  arrclear(goc->delta_list);
+
+  for(int i = 0; i < shlen(ref_children); i++)arrfree(ref_children[i].value);
+  for(int i = 0; i < hmlen(ofs_children); i++)arrfree(ofs_children[i].value);
+  shfree(ref_children);
+  hmfree(ofs_children);
+  arrfree(ready);
+  return dropped;
 }
 
-Process spawnSshProcess(GitObjectCollection* goc){
-  char* ssh_command = concatStrings((char*[]){"git-upload-pack '", goc->name, "'", NULL});
-  char* args[] = {"ssh", SSH_MASTER_ARGS, "-S", goc->socket, goc->domain, ssh_command, NULL};
-  Process ssh = doublePopen("ssh", args);
-  free(ssh_command);
-  return ssh;
+void limitWantedBlob(GitObjectCollection* goc, WantedObject* want, size_t max_size){
+  want->max_size = max_size ? max_size : max_blob_size;
+  SizeMap* known = shgetp_null(goc->oversized, want->hash);
+  if(known && isOversized(want, known->value))skipOversizedBlob(goc, want, known->value);
+  // a blob we already have isn't fetched, so nobody would look at its size otherwise,
+  // and it can be there for another line that has no limit, or a bigger one
+  GitObject* o = want->max_size && !want->is_oversized && !want->is_needed ? findObject(goc, want->hash) : NULL;
+  if(o && isOversized(want, o->length))skipOversizedBlob(goc, want, o->length);
 }
 
-bool updateObjectCollection(GitObjectCollection* goc){
-  Process ssh = spawnSshProcess(goc);
+void forgetOversizedBlobs(GitObjectCollection* goc){
+  // so they don't end up in the .goc or the tree, unless some other line still wants them,
+  // this waits until after the fetch, since the old checkout can be the base of a thin pack delta
+  for(int i = 0; i < arrlen(goc->want_list); i++){
+    if(!goc->want_list[i].is_oversized)continue;
+    bool is_wanted = false;
+    bool is_checked_out = false;
+    for(int j = 0; j < arrlen(goc->want_list); j++){
+      if(goc->want_list[j].is_oversized)continue;
+      is_wanted |= strcmp(goc->want_list[j].hash, goc->want_list[i].hash) == 0;
+      is_checked_out |= strcmp(goc->want_list[j].path, goc->want_list[i].path) == 0;
+    }
+    GitObject* o = shgetp_null(goc->hashmap, goc->want_list[i].hash);
+    if(!is_wanted && o && !o->is_saved)(void)shdel(goc->hashmap, goc->want_list[i].hash);
+
+    // whatever was checked out there before is out of date now
+    if(!is_checked_out){
+      char* path = concatStrings((char*[]){goc->treepath, "/", goc->want_list[i].path, NULL});
+      unlink(path);
+      free(path);
+    }
+  }
+}
 
-  char* branch = selectGitBranch(ssh.output_pipe, goc->branch);
-  if(feof(ssh.output_pipe) || strcmp(branch, goc->last_commit) == 0){
-    // todo?: closing the process here synchronously costs another 100ms
-    closeProcess(&ssh);
-    return false;
+void checkoutBlob(GitObjectCollection* goc, WantedObject* want, GitObject* o){
+  // the old file might still be mapped as some other blob, so it gets replaced instead of overwritten
+  if(want->is_oversized)return;
+  if(isOversized(want, o->length)){
+    skipOversizedBlob(goc, want, o->length);
+    return;
+  }
+  char* path = concatStrings((char*[]){goc->treepath, "/", want->path, NULL});
+  char* tmp_path = concatStrings((char*[]){path, ".XXXXXX", NULL});
+  mkdir_parents(path);
+  int fd = mkostemp(tmp_path, O_CLOEXEC);
+  FILE* file = fd < 0 ? NULL : fdopen(fd, "wb");
+  if(file == NULL){
+    fprintf(stderr, ERROR"failed to open file \x1b[32m%s\x1b[0m: %m\n", want->path);
+    fprintf(stderr, "\u2570"INFO"full name: %s\n", path);
   }else{
-    fprintf(stderr, INFO"updating repository %s:\x1b[32m%s\x1b[0m[%s]\n", goc->domain, goc->name, goc->branch);
-    memcpy(goc->last_commit, branch, sizeof(goc->last_commit));
+    fwrite(o->data, o->length, 1, file);
+    fchmod(fileno(file), want->is_executable ? 0755 : 0644);
+    if(fclose(file) != 0 || rename(tmp_path, path) != 0){
+      fprintf(stderr, ERROR"failed to write file \x1b[32m%s\x1b[0m: %m\n", want->path);
+      remove(tmp_path);
+    }
   }
+  free(tmp_path);
+  free(path);
+}
 
-  printfPktLine(ssh.input_pipe, "want %s multi_ack filter no-progress", branch);
-  sendPktLine(ssh.input_pipe, "deepen 1");
-  sendPktLine(ssh.input_pipe, "filter blob:none");
-  sendPktLine(ssh.input_pipe, NULL);
-  for(int i = 0; i < shlen(goc->hashmap); i++){
-    if(goc->hashmap[i].type != OBJ_TREE)continue;
-    printfPktLine(ssh.input_pipe, "have %s", goc->hashmap[i].key);
+typedef struct CheckoutTarget {
+  char* key;
+  int* wants; // indices into want_list, one blob can live at several paths
+  bool is_written;
+} CheckoutTarget;
+
+bool findCheckoutBase(GitObjectCollection* goc, CheckoutTarget* targets, const char* hash, GitObject* base, MmapedFile* file){
+  // blobs from this pack are read back from the tree, everything else is in the object store
+  CheckoutTarget* t = shgetp_null(targets, hash);
+  if(t && t->is_written){
+    int i = 0;
+    while(goc->want_list[t->wants[i]].is_oversized)i++;
+    char* path = concatStrings((char*[]){goc->treepath, "/", goc->want_list[t->wants[i]].path, NULL});
+    *file = readFile(path, true);
+    free(path);
+    *base = (GitObject){.data = (uint8_t*)file->data, .length = file->len, .type = OBJ_BLOB};
+    return true;
   }
-  sendPktLine(ssh.input_pipe, NULL);
-  sendPktLine(ssh.input_pipe, "done\n");
 
-  readPktLinesUntil(ssh.output_pipe, NULL);
-  readPktLinesUntil(ssh.output_pipe, "NAK");
-  free(readPktLine(ssh.output_pipe));
+  GitObject* o = findObject(goc, hash);
+  if(o == NULL)return false;
+  *base = *o;
+  return true;
+}
+
+bool applyCheckoutDelta(GitObjectCollection* goc, CheckoutTarget* targets, Arena* arena, GitDelta* delta, const char* base_hash, GitObject* res){
+  GitObject base;
+  MmapedFile file = {0};
+  if(!findCheckoutBase(goc, targets, base_hash, &base, &file))return false;
+  *res = applyDelta(arena, &base, delta);
+  if(file.fd)closeFile(file);
+  return true;
+}
+
+void storeCheckoutObject(GitObjectCollection* goc, CheckoutTarget* targets, GitObject* o){
+  CheckoutTarget* t = shgetp_null(targets, o->key);
+  if(t){
+    for(int i = 0; i < arrlen(t->wants); i++){
+      checkoutBlob(goc, &goc->want_list[t->wants[i]], o);
+      t->is_written |= !goc->want_list[t->wants[i]].is_oversized;
+    }
+  }
+  if((t == NULL || !t->is_written) && !findObject(goc, o->key)){
+    // we didn't ask for it, or it was too big, but a later delta might need it as a base
+    GitObject tmp = *o;
+    tmp.data = Arena_alloc(&goc->arena, o->length);
+    memcpy(tmp.data, o->data, o->length);
+    shputs(goc->hashmap, tmp);
+  }
+}
+
+void freeCheckoutTargets(CheckoutTarget* targets){
+  for(int i = 0; i < shlen(targets); i++){
+    arrfree(targets[i].wants);
+  }
+  shfree(targets);
+}
+
+int readPackFileToDisk(FILE* f, bool sideband, GitObjectCollection* goc){
+  // for full clones: every wanted blob is written to the tree as soon as it's complete
+  // and deltas read their base back from there, so only one object at a time has to be in memory
+  CheckoutTarget* volatile targets = NULL;
+  sh_new_arena(targets);
+  for(int i = 0; i < arrlen(goc->want_list); i++){
+    if(!goc->want_list[i].is_needed || goc->want_list[i].is_fetched)continue;
+    CheckoutTarget* t = shgetp_null(targets, goc->want_list[i].hash);
+    if(t == NULL){
+      CheckoutTarget tmp = {.key = goc->want_list[i].hash};
+      shputs(targets, tmp);
+      t = shgetp_null(targets, goc->want_list[i].hash);
+    }
+    arrput(t->wants, i);
+  }
+  hmfree(goc->offset_map);
+
+  DeflateBuffer buf = {.file = f, .sideband = sideband};
+  Arena scratch = {0};
+  GitDelta* volatile deferred = NULL; // ref deltas against objects that come later in the pack
+  jmp_buf on_error;
+  jmp_buf* outer_error = pull_error;
+  if(setjmp(on_error)){
+    // inflateEnd() is fine with a stream that was never started or has already ended
+    pull_error = outer_error;
+    inflateEnd(&buf.zlib);
+    freeCheckoutTargets(targets);
+    for(int i = 0; i < arrlen(deferred); i++)free(deferred[i].data);
+    arrfree(deferred);
+    Arena_release(&scratch);
+    failPull();
+  }
+  pull_error = &on_error;
+
+  uint32_t count = readPackHeader(&buf);
+  inflateInit(&buf.zlib);
+  for(uint32_t i = 0; i < count; i++){
+    PackEntry e;
+    readPackEntryHeader(&buf, &e);
+    GitObject o = {.length = e.length, .type = e.type};
+
+    if(e.type == OBJ_BLOB && e.length >= stream_blob_size){
+      char* tmp_path = inflateBlobToFile(goc, &buf, &e);
+      CheckoutTarget* t = shgetp_null(targets, e.key);
+      WantedObject* want = t ? findWantByHash(goc, e.key, e.length) : NULL;
+      o.key = e.key;
+      o.data = placeStreamedBlob(goc, tmp_path, &e, want);
+      free(tmp_path);
+      if(want){
+        for(int j = 0; j < arrlen(t->wants); j++){
+          if(&goc->want_list[t->wants[j]] != want)checkoutBlob(goc, &goc->want_list[t->wants[j]], &o);
+        }
+        t->is_written = true;
+      }else if(!findObject(goc, e.key)){
+        shputs(goc->hashmap, o);
+      }
+
+      PackOffset po = {.key = e.pack_offset};
+      memcpy(po.value, e.key, sizeof(po.value));
+      hmputs(goc->offset_map, po);
+      continue;
+    }
+
+    o.data = Arena_alloc(&scratch, e.length);
+    if(e.type < OBJ_OFS_DELTA){
+      SHA_CTX sha1context;
+      GitHash_init(&sha1context, e.type, e.length);
+      DeflateBuffer_run(&buf, o.data, o.length, &sha1context);
+      GitHash_final(&sha1context, e.key);
+    }else{
+      GitDelta delta = {.type = e.type, .data = o.data, .length = e.length, .pack_offset = e.pack_offset};
+      DeflateBuffer_run(&buf, delta.data, delta.length, NULL);
+
+      char base_hash[GIT_HASH_LEN+1];
+      if(e.type == OBJ_OFS_DELTA){
+        PackOffset* po = hmgetp_null(goc->offset_map, e.offset);
+        if(po == NULL){
+          fprintf(stderr, ERROR"no object at pack offset %ju\n", e.offset);
+          failPull();
+        }
+        memcpy(base_hash, po->value, sizeof(base_hash));
+      }else{
+        memcpy(base_hash, sha1tohex(e.ref_hash), sizeof(base_hash));
+      }
+
+      if(!applyCheckoutDelta(goc, targets, &scratch, &delta, base_hash, &o)){
+        delta.data = malloc(delta.length);
+        memcpy(delta.data, o.data, delta.length);
+        memcpy(delta.ref_hash, e.ref_hash, sizeof(delta.ref_hash));
+        arrput(deferred, delta);
+        Arena_reset(&scratch);
+        continue;
+      }
+      memcpy(e.key, o.key, sizeof(e.key));
+    }
+    o.key = e.key;
+    storeCheckoutObject(goc, targets, &o);
+
+    PackOffset po = {.key = e.pack_offset};
+    memcpy(po.value, e.key, sizeof(po.value));
+    hmputs(goc->offset_map, po);
+    Arena_reset(&scratch);
+  }
+  inflateEnd(&buf.zlib);
+  if(sideband)while(readSidebandPkt(f, buf.buff));
+
+  for(bool progress = true; progress && arrlen(deferred);){
+    progress = false;
+    for(int i = 0; i < arrlen(deferred); i++){
+      GitObject o;
+      char base_hash[GIT_HASH_LEN+1];
+      memcpy(base_hash, sha1tohex(deferred[i].ref_hash), sizeof(base_hash));
+      if(!applyCheckoutDelta(goc, targets, &scratch, &deferred[i], base_hash, &o))continue;
+
+      char key[GIT_HASH_LEN+1];
+      memcpy(key, o.key, sizeof(key));
+      o.key = key;
+      storeCheckoutObject(goc, targets, &o);
+      Arena_reset(&scratch);
+      free(deferred[i].data);
+      arrdelswap(deferred, i);
+      i--;
+      progress = true;
+    }
+  }
+  int dropped = arrlen(deferred);
+
+  for(int i = 0; i < shlen(targets); i++){
+    for(int j = 0; j < arrlen(targets[i].wants); j++){
+      goc->want_list[targets[i].wants[j]].is_fetched = targets[i].is_written;
+    }
+    // a blob that was too big for all its wants did come, it just wasn't written
+    bool is_skipped = goc->want_list[targets[i].wants[0]].is_oversized;
+    if(!targets[i].is_written && !is_skipped && !goc->is_thin){
+      fprintf(stderr, ERROR"the server didn't send blob %s\n", targets[i].key);
+      FPRINTF_REPO_INFO(goc);
+    }
+  }
+  pull_error = outer_error;
+  freeCheckoutTargets(targets);
+  for(int i = 0; i < arrlen(deferred); i++)free(deferred[i].data);
+  arrfree(deferred);
+  Arena_release(&scratch);
+  return dropped;
+}
+
+void writeSizedString(FILE* f, char* str){
+  size_t len = strlen(str);
+  fwrite(&len, sizeof(size_t), 1, f);
+  fwrite(str, 1, len, f);
+}
+
+bool readSizedString(MmapedFile* f, size_t* pos, char** str){
+  size_t len = SIZE_MAX;
+  if(*pos + sizeof(size_t) > f->len)return false;
+  memcpy(&len, f->data + *pos, sizeof(size_t));
+  *pos += sizeof(size_t);
+  if(len > f->len - *pos)return false;
+  *str = strndup(f->data + *pos, len);
+  *pos += len;
+  return *str != NULL;
+}
+
+void writePadding(FILE* f, size_t align){
+  while(ftell(f) % align)fputc('\0', f);
+}
+
+void addHaveCommit(GitObjectCollection* goc, const char* hex, HaveCommit** res){
+  HaveCommit tmp = {0};
+  memcpy(tmp.hash, hex, GIT_HASH_LEN);
+  GitObject* o = findObject(goc, tmp.hash);
+  if(o == NULL || o->type != OBJ_COMMIT || o->length < 5+GIT_HASH_LEN)return;
+  memcpy(tmp.tree, o->data+5, GIT_HASH_LEN);
+
+  // the timestamp is the first number after the '>' on the committer line
+  const char* data = (const char*)o->data;
+  const char* committer = memmem(data, o->length, "\ncommitter ", 11);
+  const char* end = committer ? memchr(committer+1, '\n', data + o->length - committer - 1) : NULL;
+  if(end){
+    const char* gt = end;
+    while(gt > committer && *gt != '>')gt--;
+    tmp.time = strtol(gt+1, NULL, 10);
+  }
+  arrput(*res, tmp);
+}
+
+int compareHaveCommits(const void* a, const void* b){
+  long x = ((const HaveCommit*)a)->time;
+  long y = ((const HaveCommit*)b)->time;
+  return (y > x) - (y < x);
+}
+
+HaveCommit* findHaveCommits(GitObjectCollection* goc, int max){
+  // the newest commits we hold, one of them is almost always an ancestor of the new head
+  HaveCommit* res = NULL;
+  for(int i = 0; i < arrlen(goc->cache_segments); i++){
+    const GocSegment* seg = &goc->cache_segments[i];
+    for(size_t j = 0; j < seg->entries; j++){
+      if(seg->table[j].type != OBJ_COMMIT || seg->table[j].flags & GOC_ENTRY_DELETED)continue;
+      addHaveCommit(goc, sha1tohex((uint8_t*)seg->hashes + j*(GIT_HASH_LEN/2)), &res);
+    }
+  }
+  for(int i = 0; i < shlen(goc->hashmap); i++){
+    if(goc->hashmap[i].type != OBJ_COMMIT || goc->hashmap[i].is_saved)continue;
+    addHaveCommit(goc, goc->hashmap[i].key, &res);
+  }
+  if(res)qsort(res, arrlen(res), sizeof(HaveCommit), compareHaveCommits);
+  if(arrlen(res) > max)arrsetlen(res, max);
+  return res;
+}
+
+void markTree(GitObjectCollection* goc, const char* hash, StringMap** reachable){
+  // every tree under a commit we keep is kept, or the server would think we have subtrees that we don't,
+  // and so is every blob, since another config that shares the .goc can track other paths than ours
+  if(shgetp_null(*reachable, hash))return;
+  GitObject* o = findObject(goc, hash);
+  if(o == NULL || o->type != OBJ_TREE)return;
+  shput(*reachable, hash, NULL);
+
+  char* tree_data = (char*)o->data;
+  char* tree_end = tree_data + o->length;
+  for(char* str = tree_data; str < tree_end; str += strlen(str) + 1 + GIT_HASH_LEN/2){
+    long file_mode = strtol(str, &str, 8);
+    str++;
+    char child[GIT_HASH_LEN+1];
+    memcpy(child, sha1tohex((uint8_t*)str + strlen(str) + 1), sizeof(child));
+    if(file_mode == 040000)markTree(goc, child, reachable);
+    else if(file_mode != 0160000)shput(*reachable, child, NULL);
+  }
+}
+
+StringMap* findReachableObjects(GitObjectCollection* goc){
+  // the newest keep_commits commits with everything in them, the rest is history that nobody is going to ask for,
+  // NULL means keep everything
+  if(keep_commits <= 0 || goc->last_commit[0] == '\0')return NULL;
+  StringMap* res = NULL;
+  sh_new_strdup(res);
+
+  HaveCommit* commits = findHaveCommits(goc, keep_commits);
+  bool has_last = false;
+  for(int i = 0; i < arrlen(commits); i++){
+    has_last |= strcmp(commits[i].hash, goc->last_commit) == 0;
+  }
+  // its committer date can be older than that of a commit we had before a force push
+  if(!has_last)addHaveCommit(goc, goc->last_commit, &commits);
+  for(int i = 0; i < arrlen(commits); i++){
+    shput(res, commits[i].hash, NULL);
+    markTree(goc, commits[i].tree, &res);
+  }
+  arrfree(commits);
+  return res;
+}
+
+typedef struct GocSaveEntry {
+  uint8_t hash[GIT_HASH_LEN/2];
+  GocEntry entry;
+  uint8_t* data;
+  const char* path; // for GOC_ENTRY_EXTERNAL
+} GocSaveEntry;
+
+int compareGocSaveEntries(const void* a, const void* b){
+  // an object that is both deleted and saved again in the same segment comes out saved
+  const GocSaveEntry* x = a;
+  const GocSaveEntry* y = b;
+  int cmp = memcmp(x->hash, y->hash, GIT_HASH_LEN/2);
+  if(cmp)return cmp;
+  return (int)(x->entry.flags & GOC_ENTRY_DELETED) - (int)(y->entry.flags & GOC_ENTRY_DELETED);
+}
+
+void sortGocSaveEntries(GocSaveEntry** list){
+  if(*list == NULL)return;
+  qsort(*list, arrlenu(*list), sizeof(GocSaveEntry), compareGocSaveEntries);
+  size_t count = 0;
+  for(int i = 0; i < arrlen(*list); i++){
+    if(count && memcmp((*list)[i].hash, (*list)[count-1].hash, GIT_HASH_LEN/2) == 0)continue;
+    (*list)[count++] = (*list)[i];
+  }
+  arrsetlen(*list, count);
+}
+
+bool isCheckoutCurrent(StringMap* checkouts, const char* path, const char* hash){
+  // a reference to a checkout is only good as long as nothing else got checked out over it
+  StringMap* c = shgetp_null(checkouts, path);
+  return c == NULL || strcmp(c->value, hash) == 0;
+}
+
+GocSaveEntry* listCachedObjects(GitObjectCollection* goc){
+  // the newest entry of every object in the file, without the deleted ones
+  GocSaveEntry* res = NULL;
+  StringMap* seen = NULL;
+  sh_new_strdup(seen);
+  for(int i = 0; i < arrlen(goc->cache_segments); i++){
+    const GocSegment* seg = &goc->cache_segments[i];
+    for(size_t j = 0; j < seg->entries; j++){
+      GocSaveEntry tmp = {.entry = seg->table[j]};
+      memcpy(tmp.hash, seg->hashes + j*(GIT_HASH_LEN/2), GIT_HASH_LEN/2);
+      char* hex = sha1tohex(tmp.hash);
+      if(shgetp_null(seen, hex))continue;
+      shput(seen, hex, NULL);
+
+      if(tmp.entry.flags & GOC_ENTRY_DELETED)continue;
+      if(tmp.entry.flags & GOC_ENTRY_EXTERNAL){
+        tmp.path = goc->cache.data + tmp.entry.offset;
+        if(tmp.entry.offset >= goc->cache.len || memchr(tmp.path, '\0', goc->cache.len - tmp.entry.offset) == NULL)continue;
+      }else{
+        tmp.data = (uint8_t*)goc->cache.data + tmp.entry.offset;
+        if(tmp.entry.offset > goc->cache.len || tmp.entry.length > goc->cache.len - tmp.entry.offset)continue;
+      }
+      arrput(res, tmp);
+    }
+  }
+  shfree(seen);
+  return res;
+}
+
+uint64_t writeSegment(FILE* f, GitObjectCollection* goc, GocSaveEntry* list, uint32_t segments, uint64_t prev_offset){
+  // the objects, then their index, then the footer that points at it, list has to be sorted, returns where the footer is
+  uint32_t fanout[256] = {0};
+  for(int i = 0; i < arrlen(list); i++){
+    list[i].entry.offset = ftell(f);
+    if(list[i].entry.flags & GOC_ENTRY_DELETED)list[i].entry.length = 0;
+    else if(list[i].path)fwrite(list[i].path, 1, strlen(list[i].path)+1, f);
+    else fwrite(list[i].data, 1, list[i].entry.length, f);
+    fanout[list[i].hash[0]]++;
+  }
+  for(int i = 1; i < 256; i++)fanout[i] += fanout[i-1];
+
+  GocFooter footer = {.signature = GOC_FOOTER_SIGNATURE, .segments = segments, .prev_offset = prev_offset};
+  memcpy(footer.last_commit, goc->last_commit, sizeof(footer.last_commit));
+  writePadding(f, sizeof(uint64_t));
+  footer.entries = arrlen(list);
+  footer.fanout_offset = ftell(f);
+  fwrite(fanout, sizeof(fanout), 1, f);
+  footer.hashes_offset = ftell(f);
+  for(int i = 0; i < arrlen(list); i++){
+    fwrite(list[i].hash, 1, GIT_HASH_LEN/2, f);
+  }
+  writePadding(f, sizeof(uint64_t));
+  footer.table_offset = ftell(f);
+  for(int i = 0; i < arrlen(list); i++){
+    fwrite(&list[i].entry, sizeof(GocEntry), 1, f);
+  }
+  uint64_t res = ftell(f);
+  fwrite(&footer, sizeof(GocFooter), 1, f);
+  return res;
+}
+
+bool appendSegment(GitObjectCollection* goc, GocSaveEntry* list){
+  // the header only points at the new segment once it's on disk, so a crash halfway leaves the file as it was
+  int fd = open(goc->filename, O_RDWR | O_CLOEXEC);
+  if(fd < 0)return false;
+  // somebody else might have compacted it, or added a segment of their own, since we mapped it
+  struct stat st, mapped;
+  GocHeader hdr;
+  bool ok = fstat(fd, &st) == 0 && fstat(goc->cache.fd, &mapped) == 0;
+  ok = ok && st.st_ino == mapped.st_ino && st.st_dev == mapped.st_dev;
+  ok = ok && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.footer_offset == goc->cache_footer;
+  FILE* f = ok ? fdopen(fd, "wb") : NULL;
+  if(f == NULL){
+    close(fd);
+    return false;
+  }
+
+  fseek(f, 0, SEEK_END);
+  writePadding(f, sizeof(uint64_t));
+  uint64_t footer_offset = writeSegment(f, goc, list, arrlen(goc->cache_segments)+1, goc->cache_footer);
+  ok = fflush(f) == 0 && fdatasync(fd) == 0;
+  size_t pos = offsetof(GocHeader, footer_offset);
+  ok = ok && pwrite(fd, &footer_offset, sizeof(footer_offset), pos) == sizeof(footer_offset) && fdatasync(fd) == 0;
+  ok = fclose(f) == 0 && ok;
+  if(!ok){
+    fprintf(stderr, ERROR"failed to append to file '%s': %m\n", goc->filename);
+    FPRINTF_REPO_INFO(goc);
+  }
+  return ok;
+}
+
+bool writeObjectCollection(GitObjectCollection* goc, GocSaveEntry* list){
+  // a whole new file with just one segment, which replaces the old one once it's on disk
+  char* tmpname = concatStrings((char*[]){goc->filename, ".tmp", NULL});
+  FILE* f = fopen(tmpname, "wb");
+  if(f == NULL){
+    fprintf(stderr, ERROR"can't open file '%s': %m\n", tmpname);
+    free(tmpname);
+    return false;
+  }
+
+  GocHeader hdr = {.signature = GOC_SIGNATURE, .version = GOC_VERSION};
+  fwrite(&hdr, sizeof(GocHeader), 1, f);
+  writeSizedString(f, goc->domain);
+  writeSizedString(f, goc->name);
+  writeSizedString(f, goc->branch);
+  writeSizedString(f, goc->socket);
+  hdr.footer_offset = writeSegment(f, goc, list, 1, 0);
+  fseek(f, 0, SEEK_SET);
+  fwrite(&hdr, sizeof(GocHeader), 1, f);
+
+  bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = fclose(f) == 0 && ok;
+  ok = ok && rename(tmpname, goc->filename) == 0;
+  if(ok){
+    // the rename itself is only durable once the directory is synced
+    char* dir = strndup(goc->filename, strrchr(goc->filename, '/') - goc->filename);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd >= 0){
+      fsync(fd);
+      close(fd);
+    }
+    free(dir);
+  }else{
+    fprintf(stderr, ERROR"failed to write file '%s': %m\n", goc->filename);
+    remove(tmpname);
+  }
+  free(tmpname);
+  return ok;
+}
+
+bool loadCacheSegments(GitObjectCollection* goc, MmapedFile file){
+  // walks the footers from the newest one back, each has to be in front of the one after it
+  const GocHeader* hdr = (GocHeader*)file.data;
+  bool ok = file.data != MAP_FAILED && file.len >= sizeof(GocHeader);
+  ok = ok && hdr->signature == GOC_SIGNATURE && hdr->version == GOC_VERSION;
+
+  GocSegment* segments = NULL;
+  uint64_t offset = ok ? hdr->footer_offset : 0;
+  uint64_t end = file.len;
+  uint32_t expected = 0; // how many segments are left, going by the newest footer
+  while(ok && offset){
+    const GocFooter* ft = (GocFooter*)(file.data + offset);
+    ok = offset % sizeof(uint64_t) == 0 && offset >= sizeof(GocHeader) && offset + sizeof(GocFooter) <= end;
+    ok = ok && ft->signature == GOC_FOOTER_SIGNATURE && ft->segments && (expected == 0 || ft->segments == expected);
+    ok = ok && (ft->segments == 1) == (ft->prev_offset == 0);
+    ok = ok && ft->table_offset <= offset && ft->hashes_offset <= ft->table_offset && ft->prev_offset < offset;
+    ok = ok && ft->entries < UINT32_MAX && ft->fanout_offset % sizeof(uint64_t) == 0 && ft->table_offset % sizeof(uint64_t) == 0;
+    ok = ok && ft->fanout_offset + 256*sizeof(uint32_t) <= ft->hashes_offset;
+    ok = ok && ft->hashes_offset + ft->entries*(GIT_HASH_LEN/2) <= ft->table_offset;
+    ok = ok && ft->table_offset + ft->entries*sizeof(GocEntry) <= offset;
+    ok = ok && ((uint32_t*)(file.data + ft->fanout_offset))[255] == ft->entries;
+    if(!ok)break;
+
+    GocSegment seg = {
+      .entries = ft->entries,
+      .fanout = (uint32_t*)(file.data + ft->fanout_offset),
+      .hashes = (uint8_t*)file.data + ft->hashes_offset,
+      .table = (GocEntry*)(file.data + ft->table_offset),
+    };
+    arrput(segments, seg);
+    if(offset == hdr->footer_offset){
+      memcpy(goc->last_commit, ft->last_commit, sizeof(goc->last_commit));
+      goc->last_commit[GIT_HASH_LEN] = '\0';
+    }
+    expected = ft->segments-1;
+    end = offset;
+    offset = ft->prev_offset;
+  }
+  ok = ok && arrlen(segments) > 0;
+
+  if(!ok){
+    arrfree(segments);
+    return false;
+  }
+  goc->cache = file;
+  goc->cache_segments = segments;
+  goc->cache_footer = hdr->footer_offset;
+  return true;
+}
+
+void forgetLoadedObjects(GitObjectCollection* goc){
+  // after a save, everything worth keeping is in the file, and findObject() maps it from there again when it's asked for,
+  // so a resident goc doesn't pile up objects and mappings from one pull to the next
+  shfree(goc->hashmap);
+  sh_new_arena(goc->hashmap);
+  hmfree(goc->offset_map);
+  goc->root_tree = NULL;
+  Arena_release(&goc->arena);
+  for(int i = 0; i < shlen(goc->external); i++){
+    free(goc->external[i].value);
+  }
+  shfree(goc->external);
+  sh_new_arena(goc->external);
+  for(int i = 0; i < arrlen(goc->blob_files); i++){
+    closeFile(goc->blob_files[i]);
+  }
+  arrfree(goc->blob_files);
+}
+
+void reloadObjectCollection(GitObjectCollection* goc){
+  // nothing may point into the old mapping anymore, see forgetLoadedObjects()
+  if(goc->cache.data)closeFile(goc->cache);
+  goc->cache = (MmapedFile){0};
+  arrfree(goc->cache_segments);
+  goc->cache_footer = 0;
+
+  char last_commit[GIT_HASH_LEN+1];
+  memcpy(last_commit, goc->last_commit, sizeof(last_commit));
+  MmapedFile file = readFile(goc->filename, true);
+  if(!loadCacheSegments(goc, file) && file.data != MAP_FAILED)closeFile(file);
+  memcpy(goc->last_commit, last_commit, sizeof(last_commit));
+}
+
+GocSaveEntry* listStaleCheckouts(GitObjectCollection* goc, StringMap* checkouts){
+  // deletions for the checkouts in the file that something else got checked out over,
+  // which can only have happened if one of our files changed
+  bool is_changed = false;
+  for(int i = 0; i < arrlen(goc->want_list) && !is_changed; i++){
+    is_changed = goc->want_list[i].is_changed;
+  }
+  GocSaveEntry* res = NULL;
+  for(int i = 0; i < arrlen(goc->cache_segments) && is_changed; i++){
+    const GocSegment* seg = &goc->cache_segments[i];
+    for(size_t j = 0; j < seg->entries; j++){
+      const GocEntry* e = &seg->table[j];
+      if(!(e->flags & GOC_ENTRY_EXTERNAL) || e->flags & GOC_ENTRY_DELETED)continue;
+      const char* path = goc->cache.data + e->offset;
+      if(e->offset >= goc->cache.len || memchr(path, '\0', goc->cache.len - e->offset) == NULL)continue;
+      const uint8_t* hash = seg->hashes + j*(GIT_HASH_LEN/2);
+      // an older entry of the object doesn't matter, the newest one wins anyway
+      if(isCheckoutCurrent(checkouts, path, sha1tohex((uint8_t*)hash)) || findCacheEntry(goc, hash) != e)continue;
+
+      GocSaveEntry tmp = {.entry = {.type = OBJ_BLOB, .flags = GOC_ENTRY_DELETED}};
+      memcpy(tmp.hash, hash, sizeof(tmp.hash));
+      arrput(res, tmp);
+    }
+  }
+  return res;
+}
+
+void listUnsavedObjects(GitObjectCollection* goc, StringMap* reachable, StringMap* checkouts, StringMap* checkout_paths, GocSaveEntry** res){
+  for(int i = 0; i < shlen(goc->hashmap); i++){
+    GitObject* o = &goc->hashmap[i];
+    // an old version that a thin pack needed as its base, or a tree that isn't ours anymore, is left out
+    if(o->is_saved || (reachable && shgetp_null(reachable, o->key) == NULL))continue;
+    GocSaveEntry tmp = {.entry = {.length = o->length, .type = o->type}, .data = o->data};
+    hextosha1(o->key, tmp.hash);
+
+    StringMap* ext = shgetp_null(goc->external, o->key);
+    StringMap* c = shgetp_null(checkout_paths, o->key);
+    if(ext)tmp.path = ext->value;
+    else if(c && o->type == OBJ_BLOB && o->length >= stream_blob_size)tmp.path = c->value;
+    if(tmp.path && isCheckoutCurrent(checkouts, tmp.path, o->key))tmp.entry.flags = GOC_ENTRY_EXTERNAL;
+    else tmp.path = NULL;
+    arrput(*res, tmp);
+  }
+}
+
+bool isCompactionDue(GitObjectCollection* goc){
+  // whether the segments appended since the last compaction outgrew the first one,
+  // which is as close as we get to how much of the file is dead without walking every tree in it
+  if(goc->cache.data == NULL || arrlen(goc->cache_segments) >= GOC_SEGMENTS_MAX)return true;
+  const GocSegment* first = &arrlast(goc->cache_segments);
+  size_t first_len = (const char*)(first->table + first->entries) - goc->cache.data;
+  size_t appended_len = goc->cache.len - first_len;
+  return appended_len > first_len && appended_len > GOC_COMPACT_SLACK;
+}
+
+void saveObjectCollection(GitObjectCollection* goc){
+  // new objects go into a segment at the end of the file, which only costs as much as what changed,
+  // unless it's time to compact it, then only what's reachable is written to a new file that replaces the old one
+  // big blobs that are checked out are saved as just their path
+  StringMap* checkouts = NULL;
+  StringMap* checkout_paths = NULL;
+  for(int i = 0; i < arrlen(goc->want_list); i++){
+    shput(checkouts, goc->want_list[i].path, goc->want_list[i].hash);
+    shput(checkout_paths, goc->want_list[i].hash, goc->want_list[i].path);
+  }
+
+  // the newest footer has the commit we were at, so even an empty segment is worth writing when that moved
+  bool is_moved = goc->cache.data == NULL || strcmp(((GocFooter*)(goc->cache.data + goc->cache_footer))->last_commit, goc->last_commit) != 0;
+  bool is_compacting = isCompactionDue(goc);
+  bool is_written = is_compacting;
+  bool ok = true;
+  if(!is_compacting){
+    GocSaveEntry* list = listStaleCheckouts(goc, checkouts);
+    listUnsavedObjects(goc, NULL, checkouts, checkout_paths, &list);
+    sortGocSaveEntries(&list);
+    is_written = arrlen(list) || is_moved;
+    if(is_written){
+      ok = appendSegment(goc, list);
+      if(ok && verbose){
+        fprintf(stderr, INFO"appended %d objects to the cache\n", (int)arrlen(list));
+        FPRINTF_REPO_INFO(goc);
+      }
+    }
+    arrfree(list);
+  }
+
+  if(is_compacting || !ok){
+    StringMap* reachable = findReachableObjects(goc);
+    GocSaveEntry* cached = listCachedObjects(goc);
+    GocSaveEntry* kept = NULL;
+    for(int i = 0; i < arrlen(cached); i++){
+      GocSaveEntry* e = &cached[i];
+      char* hex = sha1tohex(e->hash);
+      if(e->path && !isCheckoutCurrent(checkouts, e->path, hex))continue;
+      if(reachable && shgetp_null(reachable, hex) == NULL)continue;
+      arrput(kept, *e);
+    }
+    listUnsavedObjects(goc, reachable, checkouts, checkout_paths, &kept);
+    sortGocSaveEntries(&kept);
+
+    size_t old_len = goc->cache.len;
+    ok = writeObjectCollection(goc, kept);
+    if(ok && verbose && old_len){
+      struct stat st;
+      size_t new_len = stat(goc->filename, &st) == 0 ? st.st_size : 0;
+      fprintf(stderr, INFO"compacted the cache from %zu KiB to %zu KiB\n", old_len/1024, new_len/1024);
+      FPRINTF_REPO_INFO(goc);
+    }
+    shfree(reachable);
+    arrfree(cached);
+    arrfree(kept);
+  }
+  shfree(checkouts);
+  shfree(checkout_paths);
+
+  if(ok && is_written){
+    forgetLoadedObjects(goc);
+    reloadObjectCollection(goc);
+  }
+}
+
+bool loadObjectCollection(GitObjectCollection* goc){
+  MmapedFile file = readFile(goc->filename, true);
+  size_t pos = sizeof(GocHeader);
+
+  bool ok = loadCacheSegments(goc, file);
+  ok = ok && readSizedString(&file, &pos, &goc->domain);
+  ok = ok && readSizedString(&file, &pos, &goc->name);
+  ok = ok && readSizedString(&file, &pos, &goc->branch);
+  ok = ok && readSizedString(&file, &pos, &goc->socket);
+
+  if(!ok){
+    if(file.data != MAP_FAILED)closeFile(file);
+    arrfree(goc->cache_segments);
+    goc->cache = (MmapedFile){0};
+    free(goc->domain);
+    free(goc->name);
+    free(goc->branch);
+    free(goc->socket);
+    goc->domain = goc->name = goc->branch = goc->socket = NULL;
+    return false;
+  }
+  return true;
+}
+
+Process spawnUploadPack(GitObjectCollection* goc){
+  // v2 is requested through the environment, so ssh servers that don't AcceptEnv GIT_PROTOCOL just answer in v0
+  char** env = NULL;
+  for(char** e = environ; *e; e++){
+    if(strncmp(*e, "GIT_PROTOCOL=", 13) != 0)arrput(env, *e);
+  }
+  arrput(env, "GIT_PROTOCOL=version=2");
+  arrput(env, NULL);
+
+  Process res;
+  if(goc->transport == TRANSPORT_LOCAL){
+    char* args[] = {"git", "upload-pack", goc->name, NULL};
+    res = doublePopen("git", args, env);
+  }else{
+    char* ssh_command = concatStrings((char*[]){"git-upload-pack '", goc->name, "'", NULL});
+    char* persist = concatStrings((char*[]){"ControlPersist=", ssh_persist, NULL});
+    char* args[] = {"ssh", "-o", persist, SSH_MASTER_ARGS, "-o", "SendEnv=GIT_PROTOCOL", "-S", goc->socket, goc->domain, ssh_command, NULL};
+    res = doublePopen("ssh", args, env);
+    free(persist);
+    free(ssh_command);
+  }
+  arrfree(env);
+  return res;
+}
+
+bool openGitSession(GitObjectCollection* goc, GitSession* session){
+  long start = timems();
+  session->process = spawnUploadPack(goc);
+  session->version = 0;
+  session->is_open = true;
+  session->has_object_info = false;
+  session->writer.fd = fileno(session->process.input_pipe);
+  PktWriter* in = &session->writer;
+  FILE* out = session->process.output_pipe;
+
+  char* ref = concatStrings((char*[]){"refs/heads/", goc->branch, NULL});
+  char* branch;
+  char* line = readPktLine(out);
+  if(line && strcmp(line, "version 2") == 0){
+    // v2 only advertises what we ask for, instead of every tag and pull request ref in the repo
+    session->version = 2;
+    while((line = readPktLine(out))){
+      if(strcmp(line, "object-info") == 0)session->has_object_info = true;
+    }
+    sendPktLine(in, "command=ls-refs\n");
+    sendDelimPkt(in);
+    printfPktLine(in, "ref-prefix %s\n", ref);
+    sendPktLine(in, NULL);
+    branch = selectGitBranch(out, ref, NULL);
+  }else{
+    branch = selectGitBranch(out, ref, line);
+  }
+  free(ref);
+
+  if(feof(out)){
+    sendPktLine(in, NULL);
+    closeProcess(&session->process);
+    session->is_open = false;
+    return false;
+  }
+  if(branch[0] == '\0'){
+    fprintf(stderr, ERROR"the remote has no branch named '%s'\n", goc->branch);
+    FPRINTF_REPO_INFO(goc);
+  }
+  memcpy(session->head, branch, sizeof(session->head));
+  session->handshake_ms = timems() - start;
+  return true;
+}
+
+void closeGitSession(GitSession* session){
+  if(!session->is_open){
+    PktWriter_free(&session->writer);
+    return;
+  }
+  // todo?: closing the process here synchronously costs another 100ms
+  sendPktLine(&session->writer, NULL);
+  PktWriter_free(&session->writer);
+  closeProcess(&session->process);
+  session->is_open = false;
+}
+
+void abortGitSession(GitSession* session){
+  // after a failed pull the server might still be sending, so it's stopped instead of waited for
+  if(session->is_open && session->process.pid){
+    kill(session->process.pid, SIGTERM);
+    fclose(session->process.input_pipe);
+    fclose(session->process.output_pipe);
+    waitpid(session->process.pid, NULL, 0);
+  }
+  session->is_open = false;
+  PktWriter_free(&session->writer);
+}
+
+void startFetchCommand(GitSession* session){
+  PktWriter* in = &session->writer;
+  sendPktLine(in, "command=fetch\n");
+  sendDelimPkt(in);
+  sendPktLine(in, "no-progress\n");
+  sendPktLine(in, "ofs-delta\n");
+}
+
+bool readFetchResponse(GitObjectCollection* goc, GitSession* session, bool to_disk){
+  // false if some deltas had no base
+  FILE* out = session->process.output_pipe;
+  if(session->version == 2){
+    // after "done" there are no acknowledgments, only an optional shallow-info section before the pack
+    char* line;
+    int len;
+    while((len = readPkt(out, &line)) > 0){
+      if(line && strcmp(line, "packfile\n") == 0)break;
+    }
+    if(len <= 0){
+      fprintf(stderr, ERROR"the fetch response has no packfile section\n");
+      failPull();
+    }
+  }
+
+  int dropped = 0;
+  if(to_disk)dropped = readPackFileToDisk(out, session->version == 2, goc);
+  else readPackFile(out, session->version == 2, goc);
+  if(session->version == 0){
+    closeProcess(&session->process);
+    session->is_open = false;
+  }
+  if(!to_disk)dropped = resolveDeltas(goc);
+  if(dropped && !goc->is_thin){
+    fprintf(stderr, ERROR"%d deltas have no base object and were dropped\n", dropped);
+    FPRINTF_REPO_INFO(goc);
+  }
+  return dropped == 0;
+}
+
+void sendHaves(PktWriter* in, HaveCommit* haves, int start, int end){
+  // a shallow fetch has no parents to walk from the new head back to our commits,
+  // so only the root trees let the server leave out the subtrees that didn't change
+  for(int i = start; i < end && i < arrlen(haves); i++){
+    printfPktLine(in, "have %s", haves[i].hash);
+    printfPktLine(in, "have %s", haves[i].tree);
+  }
+}
+
+bool readAcks(FILE* out){
+  // one round of multi_ack_detailed, which always ends with a NAK
+  bool is_common = false;
+  char* line;
+  while((line = readPktLine(out)) && strcmp(line, "NAK") != 0){
+    if(strncmp(line, "ACK ", 4) == 0)is_common = true;
+  }
+  return is_common;
+}
+
+bool readAcknowledgments(FILE* out, bool* is_common){
+  // the v2 version, returns true if the server is ready and the pack follows after a delim-pkt
+  bool is_ready = false;
+  char* line;
+  int len;
+  while((len = readPkt(out, &line)) > 1){
+    if(strncmp(line, "ACK ", 4) == 0)*is_common = true;
+    if(strcmp(line, "ready\n") == 0)is_ready = true;
+  }
+  if(len < 0)failPull();
+  return is_ready;
+}
 
-  readPackFile(ssh.output_pipe, goc);
-  closeProcess(&ssh);
-  resolveDeltas(goc);
+size_t findBlobLimit(GitObjectCollection* goc){
+  // the server can leave out blobs that are too big for every want, but only if each of them has a limit
+  size_t res = 0;
+  for(int i = 0; i < arrlen(goc->want_list); i++){
+    WantedObject* want = &goc->want_list[i];
+    if(!want->is_needed)continue;
+    if(want->max_size == 0)return 0;
+    if(want->max_size > res)res = want->max_size;
+  }
+  return res;
+}
+
+void startCommitFetch(GitSession* session, bool with_blobs, bool is_thin, size_t blob_limit){
+  PktWriter* in = &session->writer;
+  startFetchCommand(session);
+  if(is_thin)sendPktLine(in, "thin-pack\n");
+  sendPktLine(in, "deepen 1\n");
+  if(!with_blobs)sendPktLine(in, "filter blob:none\n");
+  if(blob_limit){
+    char limit[32]; // printfPktLine() copies it, unlike sendPktLine()
+    snprintf(limit, sizeof(limit), "%zu", blob_limit);
+    printfPktLine(in, "filter blob:limit=%s\n", limit);
+  }
+  printfPktLine(in, "want %s", session->head);
+}
 
+bool fetchCommit(GitObjectCollection* goc, GitSession* session, HaveCommit* haves, bool with_blobs, bool to_disk){
+  // the new head without its history, and with a thin pack against the haves if there are any,
+  // only our newest commits are sent, so the request stays the same size however big the store gets,
+  // and the second round is only needed when the server has neither of the first two
+  PktWriter* in = &session->writer;
+  FILE* out = session->process.output_pipe;
+  bool is_thin = arrlen(haves) > 0;
+  bool is_common = false;
+  size_t blob_limit = with_blobs ? findBlobLimit(goc) : 0;
+  if(session->version == 2){
+    bool is_ready = false;
+    if(is_thin){
+      startCommitFetch(session, with_blobs, is_thin, blob_limit);
+      sendHaves(in, haves, 0, HAVE_FIRST_ROUND);
+      sendPktLine(in, NULL);
+      is_ready = readAcknowledgments(out, &is_common);
+    }
+    if(!is_ready){
+      startCommitFetch(session, with_blobs, is_thin, blob_limit);
+      // v2 is stateless, so the second round repeats the first one
+      sendHaves(in, haves, 0, is_common ? HAVE_FIRST_ROUND : HAVE_COMMITS_MAX);
+      sendPktLine(in, "done\n");
+      sendPktLine(in, NULL);
+    }
+  }else{
+    char* format = concatStrings((char*[]){"want %s multi_ack_detailed no-progress ofs-delta",
+      with_blobs && !blob_limit ? "" : " filter", is_thin ? " thin-pack" : "", NULL});
+    printfPktLine(in, format, session->head);
+    free(format);
+    sendPktLine(in, "deepen 1");
+    if(!with_blobs)sendPktLine(in, "filter blob:none");
+    if(blob_limit){
+      char limit[32];
+      snprintf(limit, sizeof(limit), "%zu", blob_limit);
+      printfPktLine(in, "filter blob:limit=%s", limit);
+    }
+    sendPktLine(in, NULL);
+    if(is_thin){
+      sendHaves(in, haves, 0, HAVE_FIRST_ROUND);
+      sendPktLine(in, NULL);
+    }
+    readPktLinesUntil(out, NULL);
+    if(is_thin)is_common = readAcks(out);
+    if(!is_common && arrlen(haves) > HAVE_FIRST_ROUND){
+      sendHaves(in, haves, HAVE_FIRST_ROUND, HAVE_COMMITS_MAX);
+      sendPktLine(in, NULL);
+      is_common = readAcks(out);
+    }
+    sendPktLine(in, "done\n");
+    PktWriter_flush(in);
+    readPktLine(out);
+  }
+  if(verbose && is_thin && !is_common){
+    fprintf(stderr, WARNING"the remote has none of our last %d commits\n", (int)arrlen(haves));
+    FPRINTF_REPO_INFO(goc);
+  }
+
+  goc->is_thin = is_thin;
+  bool res = readFetchResponse(goc, session, to_disk);
+  goc->is_thin = false;
+  return res;
+}
+
+bool updateObjectCollection(GitObjectCollection* goc, GitSession* session){
+  if(!session->is_open || session->head[0] == '\0' || strcmp(session->head, goc->last_commit) == 0){
+    goc->is_diffed = goc->last_commit[0] != '\0';
+    return false;
+  }
+  fprintf(stderr, INFO"updating repository %s:\x1b[32m%s\x1b[0m[%s]\n", goc->domain, goc->name, goc->branch);
+  memcpy(goc->prev_commit, goc->last_commit, sizeof(goc->prev_commit));
+  memcpy(goc->last_commit, session->head, sizeof(goc->last_commit));
+  goc->root_tree = NULL;
+  goc->is_diffed = false;
+
+  HaveCommit* haves = findHaveCommits(goc, HAVE_COMMITS_MAX);
+  bool is_complete = fetchCommit(goc, session, haves, false, false);
+  arrfree(haves);
+  if(!is_complete){
+    // the server thought we had a tree that we don't, so this time nothing is sent as a delta against our trees
+    fprintf(stderr, WARNING"some trees are missing their delta base, fetching them all again\n");
+    FPRINTF_REPO_INFO(goc);
+    if(session->is_open || openGitSession(goc, session))fetchCommit(goc, session, NULL, false, false);
+  }
   return true;
 }
 
@@ -520,77 +2334,360 @@ void createObjectCollection(GitObjectCollection* goc, char* url){
   char* cachedir = concatStrings((char*[]){getenv("HOME"), "/.cache/sprinkler/", NULL});
   mkdir_safe(cachedir);
 
+  char* local_path = NULL;
+  if(strncmp(url, "file://", 7) == 0)local_path = url+7;
+  else if(url[0] == '/' || url[0] == '.')local_path = url;
+  goc->transport = local_path ? TRANSPORT_LOCAL : TRANSPORT_SSH;
+
   char* sha = base64sha1string(url);
   char* name_start = strrchr(url, '/')+1;
   char* name_end = strstr(name_start, ".git");
+  if(name_end == NULL)name_end = name_start + strlen(name_start);
   size_t name_len = name_end - name_start;
   if(name_len > 20)name_len = 20;
   memcpy(sha, name_start, name_len);
   goc->treepath = concatStrings((char*[]){cachedir, sha, NULL});
   goc->filename = concatStrings((char*[]){cachedir, sha, ".goc", NULL});
 
-  FILE* f = fopen(goc->filename, "rb");
-  if(f == NULL){
+  if(access(goc->filename, R_OK) != 0){
     if(errno != ENOENT){
       fprintf(stderr, ERROR"can't open file '%s': %m\n", goc->filename);
     }
 
-    char* domain_start;
-    char* domain_end;
-    if(strncmp(url, "ssh://", 6) == 0){
-      domain_start = url+6;
-      domain_end = strchr(url, '/');
+    if(local_path){
+      goc->domain = strdup("file");
+      goc->name = realpath(local_path, NULL) ?: strdup(local_path);
+      goc->socket = strdup("");
     }else{
-      domain_start = url;
-      domain_end = strchr(url, ':');
-    }
+      char* domain_start;
+      char* domain_end;
+      if(strncmp(url, "ssh://", 6) == 0){
+        domain_start = url+6;
+        domain_end = strchr(domain_start, '/');
+      }else{
+        domain_start = url;
+        domain_end = strchr(url, ':');
+      }
 
-    goc->domain = strndup(domain_start, domain_end - domain_start);
-    goc->name = strdup(domain_end+1);
-    goc->branch = strdup("master");
+      goc->domain = strndup(domain_start, domain_end - domain_start);
+      goc->name = strdup(domain_end+1);
 
-    char* domain_sha = base64sha1string(goc->domain);
-    goc->socket = concatStrings((char*[]){cachedir, domain_sha, ".socket", NULL});
+      char* domain_sha = base64sha1string(goc->domain);
+      goc->socket = concatStrings((char*[]){cachedir, domain_sha, ".socket", NULL});
+    }
+    goc->branch = strdup("master");
 
     fprintf(stderr, INFO"creating a new file for %s:\x1b[32m%s\x1b[0m[%s]\n", goc->domain, goc->name, goc->branch);
   }else{
-    if(!loadObjectCollection(f, goc)){
-      fprintf(stderr, ERROR"failed to load GitObjectCollection from file '%s': %m\n", goc->filename);
-      fclose(f);
+    if(!loadObjectCollection(goc)){
+      fprintf(stderr, ERROR"failed to load GitObjectCollection from file '%s'\n", goc->filename);
       remove(goc->filename);
+      free(goc->filename);
+      free(goc->treepath);
+      free(cachedir);
       createObjectCollection(goc, url);
-    }else{
-      fclose(f);
+      return;
     }
   }
 
+  if(!goc->hashmap)sh_new_arena(goc->hashmap);
+  sh_new_arena(goc->external);
+  sh_new_arena(goc->changed);
+  sh_new_arena(goc->oversized);
   free(cachedir);
 }
 
-bool matchWildcard(const char* name, const char* pattern){
-  // based on https://github.com/gcc-mirror/gcc/blob/master/libiberty/fnmatch.c
-  // pattern is terminated by '/' or '\0'
+int compareTreeEntries(const void* a, const void* b){
+  return strcmp(((TreeEntry*)a)->name, ((TreeEntry*)b)->name);
+}
+
+DecodedTree* decodeTree(GitObjectCollection* goc, const uint8_t* hash){
+  // the names and hashes point into the object data, which never moves
+  GitObject* tree_obj = findObject(goc, sha1tohex((uint8_t*)hash));
+  assert(tree_obj && tree_obj->type == OBJ_TREE);
+  char* tree_data = (char*)tree_obj->data;
+  char* tree_end = tree_data + tree_obj->length;
+
+  size_t count = 0;
+  for(char* str = tree_data; str < tree_end; str += strlen(str) + 1 + GIT_HASH_LEN/2)count++;
 
-  for(const char* p = pattern; *p != '\0' && *p != '/'; p++){
-    if(*p == '*'){
-      char c = *++p; // char after wildcard
-      if(c == '\0' || c == '/')return true;
-      for(; *name; name++){
-        if(*name == c && matchWildcard(name, p))return true;
+  DecodedTree* res = Arena_alloc(&goc->arena, sizeof(DecodedTree));
+  res->entries = Arena_alloc(&goc->arena, count*sizeof(TreeEntry));
+  res->count = count;
+  char* str = tree_data;
+  for(size_t i = 0; i < count; i++){
+    TreeEntry* e = &res->entries[i];
+    e->mode = strtol(str, &str, 8);
+    e->name = ++str;
+    str += strlen(str) + 1;
+    e->hash = (uint8_t*)str;
+    e->subtree = NULL;
+    str += GIT_HASH_LEN/2;
+  }
+
+  // git sorts directories as if they ended in '/', we just want strcmp() order
+  qsort(res->entries, count, sizeof(TreeEntry), compareTreeEntries);
+  return res;
+}
+
+DecodedTree* decodeCommitTree(GitObjectCollection* goc, const char* commit_hash){
+  GitObject* commit = findObject(goc, commit_hash);
+  if(commit == NULL)return NULL;
+  assert(commit->type == OBJ_COMMIT);
+  assert(memcmp(commit->data, "tree ", 5) == 0);
+  uint8_t hash[GIT_HASH_LEN/2];
+  hextosha1((char*)commit->data+5, hash);
+  return decodeTree(goc, hash);
+}
+
+DecodedTree* getRootTree(GitObjectCollection* goc){
+  if(goc->root_tree)return goc->root_tree;
+  goc->root_tree = decodeCommitTree(goc, goc->last_commit);
+  assert(goc->root_tree);
+  return goc->root_tree;
+}
+
+TreeEntry* findTreeEntry(DecodedTree* tree, const char* name, size_t len){
+  size_t lo = 0;
+  size_t hi = tree->count;
+  while(lo < hi){
+    size_t mid = lo + (hi-lo)/2;
+    int cmp = strncmp(tree->entries[mid].name, name, len);
+    if(cmp == 0 && tree->entries[mid].name[len] != '\0')cmp = 1;
+    if(cmp < 0)lo = mid+1;
+    else if(cmp > 0)hi = mid;
+    else return &tree->entries[mid];
+  }
+  return NULL;
+}
+
+void addChangedPath(GitObjectCollection* goc, TreeEntry* entry, TreeEntry* new_entry, char** prefix_buf){
+  // every file under a directory that was added or deleted counts, with the other side missing
+  bool is_dir = entry->mode == 040000;
+  if(!is_dir){
+    char* path = concatStrings((char*[]){*prefix_buf, "/", entry->name, NULL});
+    shput(goc->changed, path, new_entry);
+    free(path);
+    return;
+  }
+
+  if(entry->subtree == NULL)entry->subtree = decodeTree(goc, entry->hash);
+  size_t prevlen = arrlenu(*prefix_buf);
+  (*prefix_buf)[prevlen-1] = '/';
+  memcpy(arraddnptr(*prefix_buf, strlen(entry->name)), entry->name, strlen(entry->name));
+  arrput(*prefix_buf, '\0');
+  for(size_t i = 0; i < entry->subtree->count; i++){
+    TreeEntry* e = &entry->subtree->entries[i];
+    addChangedPath(goc, e, new_entry ? e : NULL, prefix_buf);
+  }
+  arrsetlen(*prefix_buf, prevlen);
+  (*prefix_buf)[prevlen-1] = '\0';
+}
+
+void diffTrees(GitObjectCollection* goc, DecodedTree* old_tree, DecodedTree* new_tree, char** prefix_buf){
+  // both are sorted by name, so this is a merge, and a subtree with the same hash on both sides is skipped whole
+  size_t i = 0, j = 0;
+  while(i < old_tree->count || j < new_tree->count){
+    TreeEntry* a = i < old_tree->count ? &old_tree->entries[i] : NULL;
+    TreeEntry* b = j < new_tree->count ? &new_tree->entries[j] : NULL;
+    int cmp = a == NULL ? 1 : b == NULL ? -1 : strcmp(a->name, b->name);
+
+    if(cmp < 0){
+      addChangedPath(goc, a, NULL, prefix_buf);
+      i++;
+      continue;
+    }else if(cmp > 0){
+      addChangedPath(goc, b, b, prefix_buf);
+      j++;
+      continue;
+    }
+    i++;
+    j++;
+    if(a->mode == b->mode && memcmp(a->hash, b->hash, GIT_HASH_LEN/2) == 0)continue;
+
+    if(a->mode == 040000 && b->mode == 040000){
+      if(a->subtree == NULL)a->subtree = decodeTree(goc, a->hash);
+      if(b->subtree == NULL)b->subtree = decodeTree(goc, b->hash);
+      size_t prevlen = arrlenu(*prefix_buf);
+      (*prefix_buf)[prevlen-1] = '/';
+      memcpy(arraddnptr(*prefix_buf, strlen(b->name)), b->name, strlen(b->name));
+      arrput(*prefix_buf, '\0');
+      diffTrees(goc, a->subtree, b->subtree, prefix_buf);
+      arrsetlen(*prefix_buf, prevlen);
+      (*prefix_buf)[prevlen-1] = '\0';
+    }else{
+      // a file that turned into a directory or back is a deletion and an addition
+      if(a->mode == 040000 || b->mode == 040000)addChangedPath(goc, a, NULL, prefix_buf);
+      addChangedPath(goc, b, b, prefix_buf);
+    }
+  }
+}
+
+void diffCommits(GitObjectCollection* goc){
+  // fills goc->changed if we still have the tree of the commit we had before this update
+  if(goc->is_diffed || goc->prev_commit[0] == '\0' || goc->last_commit[0] == '\0')return;
+  DecodedTree* old_tree = decodeCommitTree(goc, goc->prev_commit);
+  if(old_tree == NULL)return;
+
+  char* prefix_buf = NULL;
+  arrput(prefix_buf, '\0');
+  diffTrees(goc, old_tree, getRootTree(goc), &prefix_buf);
+  arrfree(prefix_buf);
+  goc->is_diffed = true;
+
+  if(verbose){
+    fprintf(stderr, INFO"%zu files changed since %.7s\n", (size_t)shlen(goc->changed), goc->prev_commit);
+    FPRINTF_REPO_INFO(goc);
+  }
+}
+
+bool isPathChanged(GitObjectCollection* goc, const char* path){
+  return !goc->is_diffed || shgetp_null(goc->changed, path) != NULL;
+}
+
+typedef struct ActivePath {
+  uint32_t index; // which of the paths this is
+  WildcardState state; // where its pattern is after the directories above
+} ActivePath;
+
+typedef struct PathMatch {
+  uint32_t entry;
+  ActivePath path; // state is after "entry/", or 0 if the entry is what we were looking for
+} PathMatch;
+
+int comparePathMatches(const void* a, const void* b){
+  const PathMatch* x = a;
+  const PathMatch* y = b;
+  if(x->entry != y->entry)return x->entry < y->entry ? -1 : 1;
+  return x->path.index < y->path.index ? -1 : x->path.index > y->path.index;
+}
+
+size_t literalComponent(const Wildcard* wc, WildcardState state, char* buf){
+  // if the pattern can only be in one place and that is followed by plain chars up to the next '/',
+  // there is no need to look at all the entries of the tree, returns the length or -1
+  if(state & (state-1))return -1;
+  int n = __builtin_ctzll(state);
+  size_t len = 0;
+  while(!(wc->accept >> n & 1) && wc->literal[n] && wc->literal[n] != '/'){
+    buf[len++] = wc->literal[n++];
+  }
+  bool at_end = wc->accept >> n & 1 || wc->literal[n] == '/';
+  return at_end ? len : (size_t)-1;
+}
+
+void walkTreePaths(GitObjectCollection* goc, DecodedTree* tree, const Wildcard* patterns, ActivePath* active, char** prefix_buf, WantedObject** found){
+  PathMatch* matches = NULL;
+  for(int i = 0; i < arrlen(active); i++){
+    const Wildcard* wc = &patterns[active[i].index];
+    WildcardState state = active[i].state;
+    char name[WILDCARD_MAX_TOKENS];
+    size_t len = literalComponent(wc, state, name);
+
+    if(len != (size_t)-1){
+      TreeEntry* e = findTreeEntry(tree, name, len);
+      if(e == NULL)continue;
+      WildcardState end = Wildcard_step(wc, state, name, len);
+      bool is_dir = e->mode == 040000;
+      bool is_final = end & wc->accept;
+      WildcardState next = Wildcard_step(wc, end, "/", 1);
+      if(is_final && is_dir && !next){
+        fprintf(stderr, ERROR"%s/\x1b[32m%s\x1b[0m is a directory\n", *prefix_buf, e->name);
+        FPRINTF_REPO_INFO(goc);
+      }else if(!is_final && !is_dir){
+        fprintf(stderr, ERROR"%s/\x1b[32m%s\x1b[0m is not a directory\n", *prefix_buf, e->name);
+        FPRINTF_REPO_INFO(goc);
+      }else if(is_dir ? next : is_final){
+        arrput(matches, ((PathMatch){e - tree->entries, {active[i].index, is_dir ? next : 0}}));
+      }
+    }else{
+      for(size_t j = 0; j < tree->count; j++){
+        TreeEntry* e = &tree->entries[j];
+        WildcardState end = Wildcard_step(wc, state, e->name, strlen(e->name));
+        if(e->mode == 040000){
+          end = Wildcard_step(wc, end, "/", 1);
+          if(end)arrput(matches, ((PathMatch){j, {active[i].index, end}}));
+        }else if(end & wc->accept){
+          arrput(matches, ((PathMatch){j, {active[i].index, 0}}));
+        }
       }
-      return false;
+    }
+  }
+  // this keeps the matches of every path in tree order, which is the order they used to come in
+  if(matches)qsort(matches, arrlenu(matches), sizeof(PathMatch), comparePathMatches);
+
+  ActivePath* children = NULL;
+  for(int i = 0; i < arrlen(matches); i++){
+    TreeEntry* e = &tree->entries[matches[i].entry];
+    if(matches[i].path.state == 0){
+      WantedObject tmp = {.hash = strdup(sha1tohex(e->hash)), .is_executable = e->mode == 0100755};
+      tmp.is_needed = findObject(goc, tmp.hash) == NULL;
+      tmp.path = concatStrings((char*[]){*prefix_buf, "/", e->name, NULL});
+      tmp.is_changed = tmp.is_needed || isPathChanged(goc, tmp.path);
+      arrput(found[matches[i].path.index], tmp);
     }else{
-      if(*name != *p)return false;
+      arrput(children, matches[i].path);
     }
 
-    name++;
+    // every directory is walked once, for all the paths that go through it
+    bool is_last = i+1 == arrlen(matches) || matches[i+1].entry != matches[i].entry;
+    if(is_last && arrlen(children)){
+      if(e->subtree == NULL)e->subtree = decodeTree(goc, e->hash);
+      size_t prevlen = arrlenu(*prefix_buf);
+      (*prefix_buf)[prevlen-1] = '/';
+      memcpy(arraddnptr(*prefix_buf, strlen(e->name)), e->name, strlen(e->name));
+      arrput(*prefix_buf, '\0');
+      walkTreePaths(goc, e->subtree, patterns, children, prefix_buf, found);
+      arrsetlen(*prefix_buf, prevlen);
+      (*prefix_buf)[prevlen-1] = '\0';
+      arrclear(children);
+    }
   }
 
-  return *name == '\0';
+  arrfree(children);
+  arrfree(matches);
 }
 
-int findBlobByPath(GitObjectCollection* goc, const char* path, const char* tree, char** prefix_buf){
-  // the last two arguments are used for recursion and should left be NULL
+int* findBlobsByPaths(GitObjectCollection* goc, char** paths, size_t* max_sizes, size_t count){
+  // resolves all the paths in one walk of the tree, their blobs go onto want_list in order,
+  // and the result says how many of them each path got, max_sizes can be NULL
+  Wildcard* patterns = malloc(count*sizeof(Wildcard));
+  ActivePath* active = NULL;
+  for(size_t i = 0; i < count; i++){
+    if(!compileWildcard(&patterns[i], paths[i])){
+      fprintf(stderr, ERROR"bad pattern \x1b[32m%s\x1b[0m\n", paths[i]);
+      FPRINTF_REPO_INFO(goc);
+      continue;
+    }
+    arrput(active, ((ActivePath){i, Wildcard_start(&patterns[i])}));
+  }
+  WantedObject** found = calloc(count, sizeof(WantedObject*));
+  char* prefix_buf = NULL;
+  arrput(prefix_buf, '\0');
+  walkTreePaths(goc, getRootTree(goc), patterns, active, &prefix_buf, found);
+
+  int* res = NULL;
+  for(size_t i = 0; i < count; i++){
+    if(arrlen(found[i]) == 0){
+      fprintf(stderr, WARNING"no files matched pathspec \x1b[32m%s\x1b[0m\n", paths[i]);
+      FPRINTF_REPO_INFO(goc);
+    }
+    for(int j = 0; j < arrlen(found[i]); j++){
+      limitWantedBlob(goc, &found[i][j], max_sizes ? max_sizes[i] : 0);
+      arrput(goc->want_list, found[i][j]);
+    }
+    arrput(res, arrlen(found[i]));
+    arrfree(found[i]);
+  }
+
+  free(found);
+  free(patterns);
+  arrfree(prefix_buf);
+  arrfree(active);
+  return res;
+}
+
+int findAllBlobs(GitObjectCollection* goc, const char* tree, char** prefix_buf){
+  // like findBlobsByPaths(), but for every file, and a blob is only needed if the checkout has something else there
   char hash[GIT_HASH_LEN+1] = {0};
   int res = 0;
   char* prefix_arr = NULL;
@@ -600,180 +2697,465 @@ int findBlobByPath(GitObjectCollection* goc, const char* path, const char* tree,
   }
 
   if(tree == NULL){
-    GitObject* commit = shgetp(goc->hashmap, goc->last_commit);
-    assert(commit->type == OBJ_COMMIT);
+    GitObject* commit = findObject(goc, goc->last_commit);
+    assert(commit && commit->type == OBJ_COMMIT);
     assert(memcmp(commit->data, "tree ", 5) == 0);
     memcpy(hash, commit->data+5, GIT_HASH_LEN);
     tree = hash;
   }
-  GitObject* tree_obj = shgetp(goc->hashmap, tree);
-  assert(tree_obj->type == OBJ_TREE);
+  GitObject* tree_obj = findObject(goc, tree);
+  assert(tree_obj && tree_obj->type == OBJ_TREE);
 
   char* tree_data = (char*)tree_obj->data;
-  char* str = tree_data;
-  while(str < tree_data + tree_obj->length){
+  char* tree_end = tree_data + tree_obj->length;
+  for(char* str = tree_data; str < tree_end; str += strlen(str) + 1 + GIT_HASH_LEN/2){
     long file_mode = strtol(str, &str, 8);
-    bool is_dir = file_mode == 040000;
-    if(matchWildcard(++str, path)){
-      uint8_t* data = (uint8_t*)str + strlen(str) + 1;
-      memcpy(hash, sha1tohex(data), GIT_HASH_LEN);
-      char* next = strchr(path, '/');
-      if(next){
-        if(!is_dir){
-          fprintf(stderr, ERROR"%s/\x1b[32m%s\x1b[0m is not a directory\n", *prefix_buf, str);
-          FPRINTF_REPO_INFO(goc);
-          continue;
-        }
-        size_t prevlen = arrlenu(*prefix_buf);
-        (*prefix_buf)[arrlen(*prefix_buf)-1] = '/';
-        memcpy(arraddnptr(*prefix_buf, strlen(str)), str, strlen(str));
-        arrput(*prefix_buf, '\0');
-        res += findBlobByPath(goc, next+1, hash, prefix_buf);
-        arrsetlen(*prefix_buf, prevlen);
-      }else{
-        if(is_dir){
-          fprintf(stderr, ERROR"%s/\x1b[32m%s\x1b[0m is a directory\n", *prefix_buf, str);
-          FPRINTF_REPO_INFO(goc);
-          continue;
-        }
-        WantedObject tmp = {.hash = strdup(hash)};
-        tmp.is_needed = shgetp_null(goc->hashmap, hash) == NULL;
-        tmp.path = concatStrings((char*[]){*prefix_buf, "/", str, NULL});
-        arrpush(goc->want_list, tmp);
-        res++;
+    str++;
+    memcpy(hash, sha1tohex((uint8_t*)str + strlen(str) + 1), GIT_HASH_LEN);
+
+    if(file_mode == 040000){
+      size_t prevlen = arrlenu(*prefix_buf);
+      (*prefix_buf)[arrlen(*prefix_buf)-1] = '/';
+      memcpy(arraddnptr(*prefix_buf, strlen(str)), str, strlen(str));
+      arrput(*prefix_buf, '\0');
+      res += findAllBlobs(goc, hash, prefix_buf);
+      arrsetlen(*prefix_buf, prevlen);
+      (*prefix_buf)[prevlen-1] = '\0';
+    }else if(file_mode != 0160000){
+      // submodules are skipped, symlinks get checked out as files with the target in them
+      WantedObject tmp = {.hash = strdup(hash), .is_executable = file_mode == 0100755};
+      tmp.path = concatStrings((char*[]){*prefix_buf, "/", str, NULL});
+      char* path = concatStrings((char*[]){goc->treepath, "/", tmp.path, NULL});
+      tmp.is_needed = true;
+      if(access(path, R_OK) == 0){
+        MmapedFile file = readFile(path, true);
+        tmp.is_needed = strcmp(hexsha1git("blob", (uint8_t*)file.data, file.len), hash) != 0;
+        closeFile(file);
       }
+      free(path);
+      limitWantedBlob(goc, &tmp, 0);
+      arrpush(goc->want_list, tmp);
+      res++;
     }
-
-    str += strlen(str) + 1 + GIT_HASH_LEN/2;
   }
 
-  if(prefix_arr && res == 0){
-    fprintf(stderr, WARNING"no files matched pathspec \x1b[32m%s\x1b[0m\n", path);
-    FPRINTF_REPO_INFO(goc);
-  }
   arrfree(prefix_arr);
   return res;
 }
 
-bool fetchWantedBlobs(GitObjectCollection* goc){
-  int count = 0;
-  for(int i = 0; i < arrlen(goc->want_list); i++){
-    count += goc->want_list[i].is_needed;
+void findChangedBlobs(GitObjectCollection* goc){
+  // like findAllBlobs(), but only for what the last commit touched, and deleted files get deleted from the tree
+  for(int i = 0; i < shlen(goc->changed); i++){
+    TreeEntry* e = goc->changed[i].value;
+    char* path = concatStrings((char*[]){goc->treepath, goc->changed[i].key, NULL});
+    if(e == NULL){
+      unlink(path);
+      // take empty directories with it, so a file can replace one
+      for(char* slash = strrchr(path, '/'); slash > path + strlen(goc->treepath); slash = strrchr(path, '/')){
+        *slash = '\0';
+        if(rmdir(path))break;
+      }
+    }else if(e->mode != 0160000){
+      WantedObject tmp = {.hash = strdup(sha1tohex(e->hash)), .is_executable = e->mode == 0100755};
+      tmp.path = strdup(goc->changed[i].key);
+      tmp.is_needed = tmp.is_changed = true;
+      limitWantedBlob(goc, &tmp, 0);
+      arrpush(goc->want_list, tmp);
+    }
+    free(path);
+  }
+}
+
+bool reopenGitSession(GitObjectCollection* goc, GitSession* session){
+  if(session->is_open){
+    if(verbose){
+      fprintf(stderr, INFO"fetching blobs over the same session saved %ldms\n", session->handshake_ms);
+      FPRINTF_REPO_INFO(goc);
+    }
+    return true;
   }
-  if(count == 0)return false;
 
-  Process ssh = spawnSshProcess(goc);
-  char* branch = selectGitBranch(ssh.output_pipe, goc->branch);
-  if(feof(ssh.output_pipe)){
-    closeProcess(&ssh);
-    return false;
-  }else if(strcmp(branch, goc->last_commit) != 0){
+  // a v0 session is gone once it has sent a pack
+  if(!openGitSession(goc, session))return false;
+  if(strcmp(session->head, goc->last_commit) != 0){
     fprintf(stderr, WARNING"branch changed while we weren't looking\n");
     FPRINTF_REPO_INFO(goc);
   }
+  return true;
+}
+
+TreeEntry* findTreePath(GitObjectCollection* goc, DecodedTree* tree, const char* path){
+  // want paths of a full clone start with a '/'
+  while(*path == '/')path++;
+  while(tree){
+    const char* slash = strchr(path, '/');
+    TreeEntry* e = findTreeEntry(tree, path, slash ? (size_t)(slash-path) : strlen(path));
+    if(e == NULL || slash == NULL)return e;
+    if(e->mode != 040000)return NULL;
+    if(e->subtree == NULL)e->subtree = decodeTree(goc, e->hash);
+    tree = e->subtree;
+    path = slash+1;
+  }
+  return NULL;
+}
 
-  bool is_first = true;
+bool isThinFetchUseful(GitObjectCollection* goc){
+  // a thin pack of the new commit has every file that changed since prev_commit,
+  // as deltas against the old versions, so it only makes sense if we want all of them
+  if(!goc->is_diffed || goc->prev_commit[0] == '\0' || shlen(goc->changed) == 0)return false;
+
+  StringMap* needed = NULL;
   for(int i = 0; i < arrlen(goc->want_list); i++){
-    if(!goc->want_list[i].is_needed)continue;
+    // the ones that are too big don't get checked out, but they also don't need a fetch by name
+    if(goc->want_list[i].is_needed || goc->want_list[i].is_oversized)shput(needed, goc->want_list[i].hash, NULL);
+  }
+  bool res = true;
+  for(int i = 0; i < shlen(goc->changed) && res; i++){
+    TreeEntry* e = goc->changed[i].value;
+    if(e == NULL || e->mode == 0160000)continue;
+    res = shgetp_null(needed, sha1tohex(e->hash)) != NULL;
+  }
+  shfree(needed);
+  return res;
+}
 
+char** pinChangedBases(GitObjectCollection* goc){
+  // a full clone only has its blobs in the checkout, and replaces the old files while the pack is read,
+  // so the old versions that the deltas are against get mapped before that, and forgotten again after
+  char** res = NULL;
+  DecodedTree* old_tree = decodeCommitTree(goc, goc->prev_commit);
+  for(int i = 0; i < arrlen(goc->want_list) && old_tree; i++){
+    WantedObject* want = &goc->want_list[i];
+    if(!want->is_needed || !want->is_changed)continue;
+    TreeEntry* e = findTreePath(goc, old_tree, want->path);
+    if(e == NULL || e->mode == 040000)continue;
+    char hash[GIT_HASH_LEN+1];
+    memcpy(hash, sha1tohex(e->hash), sizeof(hash));
+    if(findObject(goc, hash))continue;
+
+    char* path = concatStrings((char*[]){goc->treepath, "/", want->path, NULL});
+    struct stat st;
+    uint8_t* data = stat(path, &st) == 0 ? mapBlobFile(goc, path, st.st_size) : NULL;
+    free(path);
+    if(data == NULL || strcmp(hexsha1git("blob", data, st.st_size), hash) != 0)continue;
+    GitObject tmp = {hash, data, st.st_size, OBJ_BLOB, false};
+    shputs(goc->hashmap, tmp);
+    arrput(res, shgetp_null(goc->hashmap, hash)->key);
+  }
+  return res;
+}
+
+void findOversizedBlobs(GitObjectCollection* goc, GitSession* session){
+  // asks the server how big the blobs with a limit are, so the ones that are too big never get sent
+  PktWriter* in = &session->writer;
+  bool is_first = true;
+  for(int i = 0; i < arrlen(goc->want_list) && session->has_object_info; i++){
+    if(!goc->want_list[i].is_needed || goc->want_list[i].max_size == 0)continue;
     if(is_first){
-      printfPktLine(ssh.input_pipe, "want %s no-progress", goc->want_list[i].hash);
+      sendPktLine(in, "command=object-info\n");
+      sendDelimPkt(in);
+      sendPktLine(in, "size\n");
       is_first = false;
-    }else{
-      printfPktLine(ssh.input_pipe, "want %s", goc->want_list[i].hash);
     }
+    printfPktLine(in, "oid %s", goc->want_list[i].hash);
+  }
+  if(is_first)return;
+  sendPktLine(in, NULL);
+
+  char* line;
+  FILE* out = session->process.output_pipe;
+  while((line = readPktLine(out))){
+    char* space = strchr(line, ' ');
+    if(space == NULL || space-line != GIT_HASH_LEN)continue;
+    *space = '\0';
+    size_t length = strtoull(space+1, NULL, 10);
+    for(int i = 0; i < arrlen(goc->want_list); i++){
+      WantedObject* want = &goc->want_list[i];
+      if(want->is_needed && strcmp(want->hash, line) == 0 && isOversized(want, length)){
+        skipOversizedBlob(goc, want, length);
+      }
+    }
+  }
+}
+
+int countNeededBlobs(GitObjectCollection* goc){
+  int res = 0;
+  for(int i = 0; i < arrlen(goc->want_list); i++){
+    res += goc->want_list[i].is_needed && !goc->want_list[i].is_fetched;
+  }
+  return res;
+}
+
+bool fetchWantedBlobs(GitObjectCollection* goc, GitSession* session, bool to_disk){
+  int count = countNeededBlobs(goc);
+  if(count == 0){
+    forgetOversizedBlobs(goc);
+    return false;
+  }
+  if(!reopenGitSession(goc, session))return false;
+  if(session->version == 2)findOversizedBlobs(goc, session);
+  // a blob that's too big still counts as a change, its old checkout is gone
+  count = countNeededBlobs(goc);
+  if(count == 0){
+    forgetOversizedBlobs(goc);
+    return true;
+  }
+
+  if(isThinFetchUseful(goc) && strcmp(session->head, goc->last_commit) == 0){
+    HaveCommit* haves = NULL;
+    addHaveCommit(goc, goc->prev_commit, &haves);
+    char** pinned = to_disk ? pinChangedBases(goc) : NULL;
+    fetchCommit(goc, session, haves, true, to_disk);
+    for(int i = 0; i < arrlen(pinned); i++)(void)shdel(goc->hashmap, pinned[i]);
+    arrfree(pinned);
+    arrfree(haves);
+
+    // whatever is still missing, because its base was gone or it didn't change, is asked for by name
+    for(int i = 0; i < arrlen(goc->want_list) && !to_disk; i++){
+      WantedObject* want = &goc->want_list[i];
+      want->is_fetched = want->is_needed && findObject(goc, want->hash);
+    }
+    int missing = countNeededBlobs(goc);
+    if(verbose){
+      fprintf(stderr, INFO"%d of %d blobs came in a thin pack\n", count-missing, count);
+      FPRINTF_REPO_INFO(goc);
+    }
+    if(missing == 0){
+      forgetOversizedBlobs(goc);
+      return true;
+    }
+    if(!reopenGitSession(goc, session))return false;
   }
-  sendPktLine(ssh.input_pipe, NULL);
-  sendPktLine(ssh.input_pipe, "done\n");
 
-  readPktLinesUntil(ssh.output_pipe, "NAK");
+  PktWriter* in = &session->writer;
+  bool is_first = true;
+  if(session->version == 2)startFetchCommand(session);
+  for(int i = 0; i < arrlen(goc->want_list); i++){
+    if(!goc->want_list[i].is_needed || goc->want_list[i].is_fetched)continue;
 
-  readPackFile(ssh.output_pipe, goc);
-  closeProcess(&ssh);
-  resolveDeltas(goc);
+    if(is_first && session->version == 0){
+      printfPktLine(in, "want %s no-progress ofs-delta", goc->want_list[i].hash);
+    }else{
+      printfPktLine(in, "want %s", goc->want_list[i].hash);
+    }
+    is_first = false;
+  }
+  if(session->version == 2){
+    sendPktLine(in, "done\n");
+    sendPktLine(in, NULL);
+  }else{
+    sendPktLine(in, NULL);
+    sendPktLine(in, "done\n");
+    PktWriter_flush(in);
+    readPktLinesUntil(session->process.output_pipe, "NAK");
+  }
 
+  readFetchResponse(goc, session, to_disk);
+  forgetOversizedBlobs(goc);
   return true;
 }
 
 void checkoutWantedBlobs(GitObjectCollection* goc){
   for(int i = 0; i < arrlen(goc->want_list); i++){
+    if(goc->want_list[i].is_oversized)continue;
     char* path = concatStrings((char*[]){goc->treepath, "/", goc->want_list[i].path, NULL});
-    if(goc->want_list[i].is_needed || access(path, R_OK) != 0){
-      GitObject* o = shgetp_null(goc->hashmap, goc->want_list[i].hash);
-      assert(o->type == OBJ_BLOB);
-
-      mkdir_parents(path);
-      FILE* file = fopen(path, "wb");
-      if(file == NULL){
-        fprintf(stderr, ERROR"failed to open file \x1b[32m%s\x1b[0m: %m\n", goc->want_list[i].path);
-        fprintf(stderr, "\u2570"INFO"full name: %s\n", path);
-      }else{
-        fwrite(o->data, o->length, 1, file);
-        fclose(file);
-      }
+    StringMap* ext = shgetp_null(goc->external, goc->want_list[i].hash);
+    bool is_in_place = ext && strcmp(ext->value, goc->want_list[i].path) == 0;
+    // files the last commit didn't touch were current after the last checkout
+    if(!goc->want_list[i].is_changed)is_in_place = true;
+    if(!is_in_place && (goc->want_list[i].is_needed || access(path, R_OK) != 0)){
+      GitObject* o = findObject(goc, goc->want_list[i].hash);
+      assert(o && o->type == OBJ_BLOB);
+      checkoutBlob(goc, &goc->want_list[i], o);
     }
     free(path);
   }
+  forgetOversizedBlobs(goc);
 }
 
 bool pullObjectCollection(char* url, char** paths, size_t length, size_t stride){
   GitObjectCollection goc = {0};
 
   createObjectCollection(&goc, url);
-  bool res = updateObjectCollection(&goc);
+  GitSession session = {0};
+  openGitSession(&goc, &session);
+  bool res = updateObjectCollection(&goc, &session);
+  diffCommits(&goc);
   // todo: short circuit here based on the change date of the config?
+  char** path_arr = NULL;
   for(size_t i = 0; i < length; i++){
-    findBlobByPath(&goc, *paths, NULL, NULL);
+    arrput(path_arr, *paths);
     paths = (void*)paths + stride;
   }
+  int* counts = findBlobsByPaths(&goc, path_arr, NULL, length);
+  arrfree(counts);
+  arrfree(path_arr);
 
-  res |= fetchWantedBlobs(&goc);
+  res |= fetchWantedBlobs(&goc, &session, false);
+  closeGitSession(&session);
   if(res){
     checkoutWantedBlobs(&goc);
-    FILE* f = fopen(goc.filename, "wb");
-    saveObjectCollection(f, &goc);
-    fclose(f);
+    saveObjectCollection(&goc);
   }
 
   deleteObjectCollection(&goc);
   return res;
 }
 
-bool pullObjectCollection_cursed(char* url, void** opaque_stbarr, size_t elemsize, char** path_in, char** path_out){
+bool pullObjectCollection_full(char* url, char** tree_path){
+  // blobs never go into the object store here, they're written to the tree while the pack is read
   GitObjectCollection goc = {0};
+  GitSession session = {0};
+  jmp_buf on_error;
+  jmp_buf* outer_error = pull_error;
+  if(setjmp(on_error)){
+    pull_error = outer_error;
+    abortGitSession(&session);
+    deleteObjectCollection(&goc);
+    failPull();
+  }
+  pull_error = &on_error;
 
   createObjectCollection(&goc, url);
-  bool res = updateObjectCollection(&goc);
+  goc.tracks_all = true;
+  openGitSession(&goc, &session);
+  bool res = updateObjectCollection(&goc, &session);
+  diffCommits(&goc);
+  if(goc.last_commit[0] && access(goc.treepath, R_OK) != 0){
+    findAllBlobs(&goc, NULL, NULL);
+    res |= fetchWantedBlobs(&goc, &session, true);
+  }else if(res){
+    if(goc.is_diffed)findChangedBlobs(&goc);
+    else findAllBlobs(&goc, NULL, NULL);
+    res |= fetchWantedBlobs(&goc, &session, true);
+  }
+  closeGitSession(&session);
+  if(res)saveObjectCollection(&goc);
+
+  *tree_path = strdup(goc.treepath);
+  deleteObjectCollection(&goc);
+  pull_error = outer_error;
+  return res;
+}
+
+GitObjectCollection* openObjectCollection(char* url){
+  GitObjectCollection* goc = calloc(1, sizeof(GitObjectCollection));
+  createObjectCollection(goc, url);
+  return goc;
+}
+
+void closeObjectCollection(GitObjectCollection* goc){
+  if(!goc)return;
+  deleteObjectCollection(goc);
+  free(goc);
+}
+
+// forgets what the last pull wanted, but keeps the objects and the commit we are at
+void resetObjectCollection(GitObjectCollection* goc){
+  for(int i = 0; i < arrlen(goc->want_list); i++){
+    free(goc->want_list[i].hash);
+    free(goc->want_list[i].path);
+  }
+  arrclear(goc->want_list);
+  shfree(goc->changed);
+  sh_new_arena(goc->changed);
+  goc->is_diffed = false;
+  goc->prev_commit[0] = '\0';
+}
+
+bool pullObjectCollection_resident(GitObjectCollection* goc, void** opaque_stbarr, size_t elemsize, char** path_in, char** path_out, char** hash_out, size_t* max_size){
+  resetObjectCollection(goc);
+  GitSession session = {0};
+  size_t* volatile slots = NULL; // where the output of each want went
+  // goc belongs to the caller, who has to drop it after a failure, it's only halfway updated
+  jmp_buf on_error;
+  jmp_buf* outer_error = pull_error;
+  if(setjmp(on_error)){
+    pull_error = outer_error;
+    abortGitSession(&session);
+    arrfree(slots);
+    failPull();
+  }
+  pull_error = &on_error;
+  openGitSession(goc, &session);
+  bool res = updateObjectCollection(goc, &session);
+  diffCommits(goc);
 
   size_t length = arrlenu(*opaque_stbarr);
   ptrdiff_t path_in_off = (char*)path_in - (char*)*opaque_stbarr;
   ptrdiff_t path_out_off = (char*)path_out - (char*)*opaque_stbarr;
+  ptrdiff_t hash_out_off = (char*)hash_out - (char*)*opaque_stbarr;
+  ptrdiff_t max_size_off = (char*)max_size - (char*)*opaque_stbarr;
+  char** path_arr = NULL;
+  size_t* size_arr = NULL;
   for(size_t i = 0; i < length; i++){
-    int count = findBlobByPath(&goc, *(char**)(*opaque_stbarr + elemsize*i + path_in_off), NULL, NULL);
+    arrput(path_arr, *(char**)(*opaque_stbarr + elemsize*i + path_in_off));
+    arrput(size_arr, max_size ? *(size_t*)(*opaque_stbarr + elemsize*i + max_size_off) : 0);
+  }
+  int* counts = findBlobsByPaths(goc, path_arr, size_arr, length);
 
+  int want_index = 0;
+  for(size_t i = 0; i < length; i++){
+    int count = counts[i];
     for(int j = 0; j < count; j++){
-      char* out_path = goc.want_list[j + arrlen(goc.want_list) - count].path;
-      char* full_path = concatStrings((char*[]){goc.treepath, "/", out_path, NULL});
-      if(j == 0){
-        *(char**)(*opaque_stbarr + elemsize*i + path_out_off) = full_path;
-      }else{
-        size_t prevlen = arrlenu(*opaque_stbarr);
+      WantedObject* want = &goc->want_list[want_index++];
+      // want paths start with a '/', without it the path is the same as the one without --custom-git
+      char* full_path = concatStrings((char*[]){goc->treepath, "/", want->path + (want->path[0] == '/'), NULL});
+      size_t index = i;
+      if(j){
+        index = arrlenu(*opaque_stbarr);
         *opaque_stbarr = stbds_arrgrowf(*opaque_stbarr, elemsize, 1, 0);
-        memcpy(*opaque_stbarr + elemsize*prevlen, *opaque_stbarr + elemsize*i, elemsize);
-        *(char**)(*opaque_stbarr + elemsize*prevlen + path_out_off) = full_path;
+        stbds_header(*opaque_stbarr)->length++;
+        memcpy(*opaque_stbarr + elemsize*index, *opaque_stbarr + elemsize*i, elemsize);
       }
+      *(char**)(*opaque_stbarr + elemsize*index + path_out_off) = full_path;
+      if(hash_out)*(char**)(*opaque_stbarr + elemsize*index + hash_out_off) = strdup(want->hash);
+      arrput(slots, index);
       // todo: if path_out_loc != NULL ==> write memory url
     }
   }
+  arrfree(counts);
+  arrfree(path_arr);
+  arrfree(size_arr);
 
-  res |= fetchWantedBlobs(&goc);
+  res |= fetchWantedBlobs(goc, &session, false);
+  closeGitSession(&session);
   if(res){
-    checkoutWantedBlobs(&goc);
-    FILE* f = fopen(goc.filename, "wb");
-    saveObjectCollection(f, &goc);
-    fclose(f);
+    checkoutWantedBlobs(goc);
+    saveObjectCollection(goc);
+  }
+  pull_error = outer_error;
+
+  // skipped blobs have no output
+  for(int i = 0; i < arrlen(slots); i++){
+    if(!goc->want_list[i].is_oversized)continue;
+    char** out = (char**)(*opaque_stbarr + elemsize*slots[i] + path_out_off);
+    free(*out);
+    *out = NULL;
+    if(hash_out){
+      out = (char**)(*opaque_stbarr + elemsize*slots[i] + hash_out_off);
+      free(*out);
+      *out = NULL;
+    }
+  }
+  arrfree(slots);
+  return res;
+}
+
+bool pullObjectCollection_cursed(char* url, void** opaque_stbarr, size_t elemsize, char** path_in, char** path_out, char** hash_out, size_t* max_size){
+  GitObjectCollection* volatile goc = NULL;
+  jmp_buf on_error;
+  jmp_buf* outer_error = pull_error;
+  if(setjmp(on_error)){
+    pull_error = outer_error;
+    closeObjectCollection(goc);
+    failPull();
   }
+  pull_error = &on_error;
 
-  deleteObjectCollection(&goc);
+  goc = openObjectCollection(url);
+  bool res = pullObjectCollection_resident(goc, opaque_stbarr, elemsize, path_in, path_out, hash_out, max_size);
+  closeObjectCollection(goc);
+  pull_error = outer_error;
   return res;
 }
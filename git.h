@@ -3,5 +3,21 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+extern int pack_threads;
+extern int parallel_pulls;
+extern size_t stream_blob_size;
+extern _Atomic size_t pkt_write_calls;
+extern char* ssh_persist;
+extern size_t max_blob_size;
+extern int keep_commits;
+
+typedef struct GitObjectCollection GitObjectCollection;
+
 bool pullObjectCollection(char* url, char** paths, size_t length, size_t stride);
-bool pullObjectCollection_cursed(char* url, void** opaque_stbarr, size_t elemsize, char** path_in, char** path_out);
+bool pullObjectCollection_full(char* url, char** tree_path);
+bool pullObjectCollection_cursed(char* url, void** opaque_stbarr, size_t elemsize, char** path_in, char** path_out, char** hash_out, size_t* max_size);
+
+// keeps the objects in memory between pulls, for --daemon
+GitObjectCollection* openObjectCollection(char* url);
+void closeObjectCollection(GitObjectCollection* goc);
+bool pullObjectCollection_resident(GitObjectCollection* goc, void** opaque_stbarr, size_t elemsize, char** path_in, char** path_out, char** hash_out, size_t* max_size);
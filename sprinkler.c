@@ -1,11 +1,20 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
 #include <strings.h>
 #include <unistd.h>
-#include <glob.h>
+#include <dirent.h>
 #include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "util.h"
 #include "git.h"
@@ -26,6 +35,15 @@ struct option longOptionRom[] = {
   {"output", required_argument, 0, 'o'},
   {"help", no_argument, 0, 'h'},
   {"custom-git", no_argument, 0, 'G'},
+  {"verbose", no_argument, 0, 'v'},
+  {"threads", required_argument, 0, 't'},
+  {"parallel", required_argument, 0, 'p'},
+  {"per-host", required_argument, 0, 'P'},
+  {"jobs", required_argument, 0, 'j'},
+  {"daemon", no_argument, 0, 'd'},
+  {"interval", required_argument, 0, 'I'},
+  {"max-blob-size", required_argument, 0, 'M'},
+  {"keep-commits", required_argument, 0, 'k'},
   {0, 0, 0, 0}
 };
 
@@ -33,14 +51,45 @@ typedef struct Command {
   char* script_path;
   char* input_path;
   char* output_path;
+  char* blob_hash; // of the input, if the git client told us, it belongs to the ConfigLine
 } Command;
 
+typedef struct BuildRecord {
+  char* key; // output path
+  char* blob; // git blob id of the input
+  char* script; // hash of the filter script, empty for copy
+  char* args;
+  long mtime; // of the input, its blob id is only computed again if this or the size changes
+  long size;
+  long ms; // how long the filter took
+} BuildRecord;
+
+typedef struct ScriptHash {
+  char* key; // script path
+  char* value;
+} ScriptHash;
+
+typedef struct ResultUse {
+  char* key; // name in the result store
+  bool value;
+} ResultUse;
+
+typedef struct FilterJob {
+  Command* cmd;
+  BuildRecord rec; // what goes into the manifest once it's done
+  pid_t pid;
+  long start;
+  FILE* err; // the stderr of the filter, so it can be printed in one piece once it's done
+} FilterJob;
+
 typedef struct ConfigLine {
   char* filter;
   char* repo;
   char* path_in_repo;
   char* output;
   char* src_path;
+  char* blob_hash; // only known with --custom-git
+  size_t max_size; // bigger files are skipped, 0 means --max-blob-size
 } ConfigLine;
 
 typedef struct RepoList {
@@ -48,10 +97,40 @@ typedef struct RepoList {
   ConfigLine* value;
   char* git_path;
   char* tree_path;
+  char* host;
   bool do_full_clone;
+  size_t line_count; // lines from the config, the ones after it are files matched by a pattern
+  long interval; // seconds between pulls in --daemon mode, 0 means --interval
+  long next_poll;
+  bool is_due;
+  bool changed;
+  bool failed; // the last pull of it went wrong, so none of its files are used
+  GitObjectCollection* goc; // stays in memory between pulls in --daemon mode
 } RepoList;
 
+typedef struct HostSlots {
+  char* key;
+  int active;
+  bool warm;
+} HostSlots;
+
+typedef struct RepoScheduler {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  RepoList* repos;
+  bool* started;
+  size_t remaining;
+  HostSlots* hosts;
+  void (*job)(RepoList*);
+} RepoScheduler;
+
 bool use_custom_git = false;
+int parallel_repos = 4;
+int connections_per_host = 2;
+int parallel_filters = 1;
+long result_max_age = 30*24*60*60; // seconds a result nothing was built from is kept, for renamed outputs or other configs
+bool daemon_mode = false;
+long poll_interval = 2*60*60;
 
 char* nextField(char** datap, const char* substr){
   if(*datap == NULL)return NULL;
@@ -71,6 +150,27 @@ char* nextField(char** datap, const char* substr){
   return res;
 }
 
+long parseDuration(const char* str){
+  char* end;
+  long res = strtol(str, &end, 10);
+  if(end == str || res <= 0)return -1;
+  if(*end == 'm')res *= 60, end++;
+  else if(*end == 'h')res *= 60*60, end++;
+  else if(*end == 'd')res *= 24*60*60, end++;
+  else if(*end == 's')end++;
+  return *end ? -1 : res;
+}
+
+long parseSize(const char* str){
+  char* end;
+  long res = strtol(str, &end, 10);
+  if(end == str || res <= 0)return -1;
+  if(*end == 'k' || *end == 'K')res <<= 10, end++;
+  else if(*end == 'M')res <<= 20, end++;
+  else if(*end == 'G')res <<= 30, end++;
+  return *end ? -1 : res;
+}
+
 RepoList* parseConfig(char* data){
   RepoList* res = NULL;
 
@@ -88,6 +188,18 @@ RepoList* parseConfig(char* data){
     char* output = nextField(&line, "\t");
     char* all = nextField(&line, "\t");
     bool do_full_clone = all && (strcmp(all, "1") == 0 || strcasecmp(all, "true") == 0);
+    char* interval_str = nextField(&line, "\t");
+    long interval = 0;
+    if(interval_str && *interval_str && (interval = parseDuration(interval_str)) < 0){
+      fprintf(stderr, WARNING"bad interval \x1b[33m'%s'\x1b[0m on line %d\n", interval_str, i);
+      interval = 0;
+    }
+    char* size_str = nextField(&line, "\t");
+    long max_size = 0;
+    if(size_str && *size_str && (max_size = parseSize(size_str)) < 0){
+      fprintf(stderr, WARNING"bad size \x1b[33m'%s'\x1b[0m on line %d\n", size_str, i);
+      max_size = 0;
+    }
 
     if(line != NULL){
       fprintf(stderr, WARNING"extra text \x1b[33m'%s'\x1b[0m on line %d\n", line, i);
@@ -110,10 +222,14 @@ RepoList* parseConfig(char* data){
       shputs(res, tmp);
       entry = shgetp_null(res, repo);
     }
-    arrpush(entry->value, ((ConfigLine){filter, repo, path_in_repo, output, NULL}));
+    arrpush(entry->value, ((ConfigLine){filter, repo, path_in_repo, output, NULL, NULL, max_size}));
     entry->do_full_clone |= do_full_clone;
+    if(interval && (entry->interval == 0 || interval < entry->interval))entry->interval = interval;
   }
 
+  for(int j = 0; j < shlen(res); j++){
+    res[j].line_count = arrlen(res[j].value);
+  }
   return res;
 }
 
@@ -121,14 +237,32 @@ void freeConfig(RepoList* arr){
   for(int i = 0; i < shlen(arr); i++){
     for(int j = 0; j < arrlen(arr[i].value); j++){
       free(arr[i].value[j].src_path);
+      free(arr[i].value[j].blob_hash);
     }
     arrfree(arr[i].value);
+    closeObjectCollection(arr[i].goc);
     free(arr[i].git_path);
     free(arr[i].tree_path);
+    free(arr[i].host);
   }
   shfree(arr);
 }
 
+// undoes the last pull, so that the lines can be pulled again
+void resetRepoLines(RepoList* repo){
+  for(int j = 0; j < arrlen(repo->value); j++){
+    free(repo->value[j].src_path);
+    free(repo->value[j].blob_hash);
+    repo->value[j].src_path = NULL;
+    repo->value[j].blob_hash = NULL;
+  }
+  arrsetlen(repo->value, repo->line_count);
+  free(repo->tree_path);
+  free(repo->git_path);
+  repo->tree_path = NULL;
+  repo->git_path = NULL;
+}
+
 void freeCommands(Command* commands){
   for(int i = 0; i < arrlen(commands); i++){
     free(commands[i].script_path);
@@ -164,41 +298,159 @@ void partialCheckout(RepoList* repo){
   arrfree(extra_files);
 }
 
-void ensureRepos(RepoList* arr){
-  char* cachedir = concatStrings((char*[]){getenv("HOME"), "/.cache/sprinkler/", NULL});
-  mkdir_safe(cachedir);
+char* repoHost(const char* url){
+  // "git@github.com" for both "git@github.com:user/repo.git" and "ssh://git@github.com/user/repo.git"
+  bool is_url = strncmp(url, "ssh://", 6) == 0;
+  const char* start = is_url ? url+6 : url;
+  return strndup(start, strcspn(start, is_url ? "/" : ":"));
+}
+
+void* RepoScheduler_worker(void* arg){
+  RepoScheduler* rs = arg;
+  pthread_mutex_lock(&rs->lock);
+  while(rs->remaining){
+    int next = -1;
+    HostSlots* host = NULL;
+    for(int i = 0; i < shlen(rs->repos) && next < 0; i++){
+      if(rs->started[i])continue;
+      host = shgetp(rs->hosts, rs->repos[i].host);
+      // the first connection to a host goes alone, so that it can become the ssh ControlMaster
+      if(host->active < (host->warm ? connections_per_host : 1))next = i;
+    }
+    if(next < 0){
+      pthread_cond_wait(&rs->cond, &rs->lock);
+      continue;
+    }
+
+    rs->started[next] = true;
+    rs->remaining--;
+    host->active++;
+    pthread_mutex_unlock(&rs->lock);
+    rs->job(&rs->repos[next]);
+    pthread_mutex_lock(&rs->lock);
+    host->active--;
+    host->warm = true;
+    pthread_cond_broadcast(&rs->cond);
+  }
+  pthread_mutex_unlock(&rs->lock);
+  return NULL;
+}
 
+void runRepoJobs(RepoList* arr, void (*job)(RepoList*)){
+  int thread_count = parallel_repos < shlen(arr) ? parallel_repos : shlen(arr);
+  if(thread_count <= 1){
+    for(int i = 0; i < shlen(arr); i++)job(&arr[i]);
+    return;
+  }
+
+  RepoScheduler rs = {.repos = arr, .job = job, .remaining = shlen(arr)};
+  rs.started = calloc(shlen(arr), sizeof(bool));
+  pthread_mutex_init(&rs.lock, NULL);
+  pthread_cond_init(&rs.cond, NULL);
   for(int i = 0; i < shlen(arr); i++){
-    char* sha = base64sha1string(arr[i].key);
-    char* name_start = strrchr(arr[i].key, '/')+1;
-    char* name_end = strstr(name_start, ".git");
-    size_t name_len = name_end - name_start;
-    if(name_len > 20)name_len = 20;
-    memcpy(sha, name_start, name_len);
-
-    arr[i].tree_path = concatStrings((char*[]){cachedir, sha, NULL});
-    arr[i].git_path = concatStrings((char*[]){arr[i].tree_path, ".git", NULL});
-
-    if(access(arr[i].git_path, R_OK) == 0){
-      char* pull_cmd[] = {"git", "--work-tree", arr[i].tree_path, "--git-dir", arr[i].git_path, "pull", "--quiet", NULL};
-      int res = execFileSync_status("git", pull_cmd);
-      if(res){
-        fprintf(stderr, WARNING"failed to pull repo %.*s\n", (int)name_len, name_start);
-        execFileSync("rm", (char*[]){"rm", "-rf", arr[i].tree_path, arr[i].git_path, NULL});
-        goto clone;
-      }
-    }else{
-      clone:;
-      execFileSync("git", (char*[]){"git", "clone", "--depth=1", "--filter=blob:none", "--bare", arr[i].key, arr[i].git_path, NULL});
-      mkdir_safe(arr[i].tree_path);
+    if(arr[i].host == NULL)arr[i].host = repoHost(arr[i].key);
+    if(shgetp_null(rs.hosts, arr[i].host) == NULL){
+      HostSlots tmp = {.key = arr[i].host};
+      shputs(rs.hosts, tmp);
+    }
+  }
+
+  parallel_pulls = thread_count;
+  pthread_t* threads = calloc(thread_count, sizeof(pthread_t));
+  for(int i = 0; i < thread_count; i++){
+    if(pthread_create(&threads[i], NULL, RepoScheduler_worker, &rs)){
+      fprintf(stderr, ERROR"can't create a thread: %m\n");
+      exit(1);
     }
+  }
+  for(int i = 0; i < thread_count; i++){
+    pthread_join(threads[i], NULL);
+  }
+  parallel_pulls = 1;
+
+  pthread_mutex_destroy(&rs.lock);
+  pthread_cond_destroy(&rs.cond);
+  shfree(rs.hosts);
+  free(rs.started);
+  free(threads);
+}
 
-    partialCheckout(&arr[i]);
+void ensureRepo(RepoList* repo){
+  resetRepoLines(repo);
+  repo->changed = true;
+  char* cachedir = concatStrings((char*[]){getenv("HOME"), "/.cache/sprinkler/", NULL});
+  mkdir_safe(cachedir);
+
+  char* sha = base64sha1string(repo->key);
+  char* name_start = strrchr(repo->key, '/')+1;
+  char* name_end = strstr(name_start, ".git");
+  size_t name_len = name_end - name_start;
+  if(name_len > 20)name_len = 20;
+  memcpy(sha, name_start, name_len);
+
+  repo->tree_path = concatStrings((char*[]){cachedir, sha, NULL});
+  repo->git_path = concatStrings((char*[]){repo->tree_path, ".git", NULL});
+
+  if(access(repo->git_path, R_OK) == 0){
+    char* pull_cmd[] = {"git", "--work-tree", repo->tree_path, "--git-dir", repo->git_path, "pull", "--quiet", NULL};
+    int res = execFileSync_status("git", pull_cmd);
+    if(res){
+      fprintf(stderr, WARNING"failed to pull repo %.*s\n", (int)name_len, name_start);
+      execFileSync("rm", (char*[]){"rm", "-rf", repo->tree_path, repo->git_path, NULL});
+      goto clone;
+    }
+  }else{
+    clone:;
+    execFileSync("git", (char*[]){"git", "clone", "--depth=1", "--filter=blob:none", "--bare", repo->key, repo->git_path, NULL});
+    mkdir_safe(repo->tree_path);
   }
 
+  partialCheckout(repo);
   free(cachedir);
 }
 
+void pullRepo(RepoList* repo){
+  resetRepoLines(repo);
+  if(repo->do_full_clone){
+    // never resident, its blobs are only in the tree and the .goc is just mapped again, so keeping it open saves little
+    repo->changed = pullObjectCollection_full(repo->key, &repo->tree_path);
+    for(int j = 0; j < arrlen(repo->value); j++){
+      ConfigLine* line = &repo->value[j];
+      line->src_path = concatStrings((char*[]){repo->tree_path, "/", line->path_in_repo, NULL});
+    }
+    return;
+  }
+  ConfigLine* files = repo->value;
+  if(daemon_mode){
+    if(repo->goc == NULL)repo->goc = openObjectCollection(repo->key);
+    repo->changed = pullObjectCollection_resident(repo->goc, (void**)&repo->value, sizeof(*files), &files->path_in_repo, &files->src_path, &files->blob_hash, &files->max_size);
+  }else{
+    repo->changed = pullObjectCollection_cursed(repo->key, (void**)&repo->value, sizeof(*files), &files->path_in_repo, &files->src_path, &files->blob_hash, &files->max_size);
+  }
+}
+
+void pollRepo(RepoList* repo){
+  if(!repo->is_due)return;
+  // an error in here ends this pull only, the other repos go on with theirs
+  jmp_buf on_error;
+  if(setjmp(on_error)){
+    pull_error = NULL;
+    fprintf(stderr, WARNING"failed to update %s, its outputs are left as they are\n", repo->key);
+    // it's halfway through an update, so it gets loaded from its file again next time
+    closeObjectCollection(repo->goc);
+    repo->goc = NULL;
+    resetRepoLines(repo);
+    repo->changed = false;
+    repo->failed = true;
+    return;
+  }
+  pull_error = &on_error;
+  repo->failed = false;
+  if(use_custom_git)pullRepo(repo);
+  else ensureRepo(repo);
+  pull_error = NULL;
+}
+
 char* makeOutputWildcard(ConfigLine* line, char* input_path, char* output_dir){
   char* res = NULL;
 
@@ -220,12 +472,52 @@ char* makeOutputWildcard(ConfigLine* line, char* input_path, char* output_dir){
   return res;
 }
 
+int compareStrings(const void* a, const void* b){
+  return strcmp(*(char**)a, *(char**)b);
+}
+
+void findMatchingFiles(char** path_buf, const Wildcard* wc, WildcardState state, char*** res){
+  // walks the checkout like the tree walk in git.c does, only going into directories the pattern can still match
+  DIR* dir = opendir(*path_buf);
+  if(dir == NULL)return;
+
+  struct dirent* ent;
+  while((ent = readdir(dir))){
+    if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)continue;
+    WildcardState end = Wildcard_step(wc, state, ent->d_name, strlen(ent->d_name));
+    if(end == 0)continue;
+
+    size_t prevlen = arrlenu(*path_buf);
+    (*path_buf)[prevlen-1] = '/';
+    memcpy(arraddnptr(*path_buf, strlen(ent->d_name)+1), ent->d_name, strlen(ent->d_name)+1);
+
+    bool is_dir = ent->d_type == DT_DIR;
+    if(ent->d_type == DT_UNKNOWN){
+      struct stat st;
+      is_dir = stat(*path_buf, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    if(is_dir){
+      WildcardState next = Wildcard_step(wc, end, "/", 1);
+      if(next)findMatchingFiles(path_buf, wc, next, res);
+    }else if(end & wc->accept){
+      arrpush(*res, strdup(*path_buf));
+    }
+
+    arrsetlen(*path_buf, prevlen);
+    (*path_buf)[prevlen-1] = '\0';
+  }
+
+  closedir(dir);
+}
+
 Command* createCommands(RepoList* arr, char* scripts_dir, char* output_dir){
   Command* res = NULL;
 
   for(int i = 0; i < shlen(arr); i++){
     for(int j = 0; j < arrlen(arr[i].value); j++){
       ConfigLine* line = &arr[i].value[j];
+      // the file was too big, so it isn't there
+      if(line->src_path == NULL)continue;
 
       char* script_path = NULL;
       char* input_path = NULL;
@@ -235,22 +527,34 @@ Command* createCommands(RepoList* arr, char* scripts_dir, char* output_dir){
         script_path = concatStrings((char*[]){scripts_dir, "/", line->filter, NULL});
       }
 
-      if(strstr(line->path_in_repo, "*") == NULL){
+      // with --custom-git the patterns are already expanded into one line per file
+      if(!hasWildcard(line->path_in_repo) || arr[i].tree_path == NULL){
         input_path = strdup(line->src_path);
         output_path = makeOutputWildcard(line, input_path, output_dir);
-        arrpush(res, ((Command){script_path, input_path, output_path}));
+        arrpush(res, ((Command){script_path, input_path, output_path, line->blob_hash}));
       }else{
-        glob_t globbuf;
-        glob(line->src_path, GLOB_NOSORT, NULL, &globbuf);
+        Wildcard wc;
+        if(!compileWildcard(&wc, line->path_in_repo)){
+          fprintf(stderr, ERROR"bad pattern \x1b[32m%s\x1b[0m\n", line->path_in_repo);
+          free(script_path);
+          continue;
+        }
+
+        char* path_buf = NULL;
+        memcpy(arraddnptr(path_buf, strlen(arr[i].tree_path)+1), arr[i].tree_path, strlen(arr[i].tree_path)+1);
+        char** files = NULL;
+        findMatchingFiles(&path_buf, &wc, Wildcard_start(&wc), &files);
+        if(files)qsort(files, arrlen(files), sizeof(char*), compareStrings);
 
-        for(int k = 0; k < globbuf.gl_pathc; k++){
-          input_path = strdup(globbuf.gl_pathv[k]);
+        for(int k = 0; k < arrlen(files); k++){
+          input_path = files[k];
           output_path = makeOutputWildcard(line, input_path, output_dir);
-          arrpush(res, ((Command){script_path, input_path, output_path}));
+          arrpush(res, ((Command){script_path, input_path, output_path, line->blob_hash}));
           if(script_path)script_path = strdup(script_path);
         }
 
-        globfree(&globbuf);
+        arrfree(files);
+        arrfree(path_buf);
         free(script_path);
       }
     }
@@ -259,44 +563,595 @@ Command* createCommands(RepoList* arr, char* scripts_dir, char* output_dir){
   return res;
 }
 
-void runCommands(Command* commands){
+char* storePath(const char* name){
+  char* res = concatStrings((char*[]){getenv("HOME"), "/.cache/sprinkler/", (char*)name, NULL});
+  mkdir_safe(res);
+  return res;
+}
+
+bool linkFromBlobStore(char* input_path, const char* blob_hash, const char* tmp_path){
+  // the store has one inode per blob, that the checkout and every copy of it share,
+  // the input only has to be hashed if we don't know its blob id yet
+  char* hash;
+  if(blob_hash && blob_hash[0]){
+    hash = strdup(blob_hash);
+  }else{
+    MmapedFile file = readFile(input_path, true);
+    hash = strdup(hexsha1git("blob", (uint8_t*)file.data, file.len));
+    closeFile(file);
+  }
+
+  char* store_dir = storePath("blobs");
+  char* store_path = concatStrings((char*[]){store_dir, "/", hash, NULL});
+  bool res = (link(input_path, store_path) == 0 || errno == EEXIST) && link(store_path, tmp_path) == 0;
+
+  free(store_path);
+  free(store_dir);
+  free(hash);
+  return res;
+}
+
+bool copyFileData(int in, int out){
+  while(1){
+    ssize_t len = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+    if(len == 0)return true;
+    if(len > 0)continue;
+    if(errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)return false;
+    break;
+  }
+
+  // older kernels can't copy_file_range() between filesystems
+  char buf[1 << 16];
+  while(1){
+    ssize_t len = read(in, buf, sizeof(buf));
+    if(len == 0)return true;
+    if(len < 0 || write(out, buf, len) != len)return false;
+  }
+}
+
+size_t copyFilter(char* input_path, char* output_path, bool use_blob_store, const char* blob_hash){
+  // the `copy` filter, done without a cp process: a reflink if the filesystem can,
+  // otherwise a hardlink through the blob store (or straight to the input), otherwise an actual copy
+  // blob_hash is the blob id of the input if we know it, returns how many bytes that saved
+  int in = open(input_path, O_RDONLY);
+  struct stat st;
+  if(in < 0 || fstat(in, &st)){
+    fprintf(stderr, ERROR"can't open '%s': %m\n", input_path);
+    if(in >= 0)close(in);
+    return 0;
+  }
+
+  char* tmp_path = concatStrings((char*[]){output_path, ".tmp", NULL});
+  unlink(tmp_path);
+  size_t saved = 0;
+  int out = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777);
+  bool ok = out >= 0;
+  if(ok && ioctl(out, FICLONE, in) == 0){
+    saved = st.st_size;
+    close(out);
+  }else if(ok){
+    close(out);
+    unlink(tmp_path);
+    bool is_linked = st.st_size && (use_blob_store ? linkFromBlobStore(input_path, blob_hash, tmp_path) : link(input_path, tmp_path) == 0);
+    if(is_linked){
+      saved = st.st_size;
+    }else{
+      out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+      ok = out >= 0 && copyFileData(in, out);
+      if(out >= 0)close(out);
+    }
+  }
+  close(in);
+
+  if(!ok || rename(tmp_path, output_path)){
+    fprintf(stderr, ERROR"can't copy '%s' to '%s': %m\n", input_path, output_path);
+    unlink(tmp_path);
+    saved = 0;
+  }
+  free(tmp_path);
+  return saved;
+}
+
+void pruneStore(const char* name){
+  // a file that only has the link from the store left isn't used by anything
+  char* store_dir = storePath(name);
+  DIR* dir = opendir(store_dir);
+  if(dir == NULL){
+    free(store_dir);
+    return;
+  }
+
+  struct dirent* ent;
+  while((ent = readdir(dir))){
+    struct stat st;
+    if(ent->d_name[0] == '.')continue;
+    if(fstatat(dirfd(dir), ent->d_name, &st, 0) == 0 && st.st_nlink == 1)unlinkat(dirfd(dir), ent->d_name, 0);
+  }
+
+  closedir(dir);
+  free(store_dir);
+}
+
+char* manifestPath(char* output_dir){
+  // one manifest per output directory, so different configs don't fight over it
+  char* real_dir = realpath(output_dir, NULL);
+  char* name = base64sha1string(real_dir ?: output_dir);
+  char* res = concatStrings((char*[]){getenv("HOME"), "/.cache/sprinkler/manifest-", name, ".tsv", NULL});
+  free(real_dir);
+  return res;
+}
+
+void freeBuildRecord(BuildRecord* rec){
+  free(rec->blob);
+  free(rec->script);
+  free(rec->args);
+}
+
+BuildRecord* readManifest(char* path){
+  // what every output was last built from, as "output\tblob\tscript\tmtime\tsize\tms\targs" lines
+  BuildRecord* res = NULL;
+  sh_new_strdup(res);
+  if(access(path, R_OK) == 0){
+    MmapedFile file = readFile(path, false);
+    char* data = file.data;
+    while(data){
+      char* line = nextField(&data, "\n");
+      char* fields[6];
+      for(int i = 0; i < 6; i++)fields[i] = nextField(&line, "\t");
+      if(line == NULL)continue;
+      BuildRecord tmp = {.key = fields[0], .blob = strdup(fields[1]), .script = strdup(fields[2]), .args = strdup(line)};
+      tmp.mtime = atol(fields[3]);
+      tmp.size = atol(fields[4]);
+      tmp.ms = atol(fields[5]);
+      shputs(res, tmp);
+    }
+    closeFile(file);
+  }
+  return res;
+}
+
+BuildRecord* loadManifest(char* output_dir){
+  char* path = manifestPath(output_dir);
+  BuildRecord* res = readManifest(path);
+  free(path);
+  return res;
+}
+
+void saveManifest(char* output_dir, Command* commands, BuildRecord* manifest){
+  // only the outputs that are still in the config are kept
+  char* path = manifestPath(output_dir);
+  char* tmp_path = concatStrings((char*[]){path, ".tmp", NULL});
+  FILE* f = fopen(tmp_path, "w");
+  if(f){
+    for(int i = 0; i < arrlen(commands); i++){
+      BuildRecord* r = shgetp_null(manifest, commands[i].output_path);
+      if(r == NULL)continue;
+      fprintf(f, "%s\t%s\t%s\t%ld\t%ld\t%ld\t%s\n", r->key, r->blob, r->script, r->mtime, r->size, r->ms, r->args);
+    }
+    fclose(f);
+    rename(tmp_path, path);
+  }
+  free(tmp_path);
+  free(path);
+}
+
+void freeManifest(BuildRecord* manifest){
+  for(int i = 0; i < shlen(manifest); i++){
+    freeBuildRecord(&manifest[i]);
+  }
+  shfree(manifest);
+}
+
+void recordBuild(BuildRecord** manifest, BuildRecord* rec){
+  BuildRecord* old = shgetp_null(*manifest, rec->key);
+  if(old)freeBuildRecord(old);
+  shputs(*manifest, *rec);
+}
+
+char* inputBlobHash(Command* cmd, BuildRecord* old, long* mtime, long* size){
+  // the git blob id of the input, which only has to be computed if the file looks different from last time
+  struct stat st;
+  if(stat(cmd->input_path, &st))return NULL;
+  *mtime = st.st_mtime;
+  *size = st.st_size;
+  if(cmd->blob_hash)return strdup(cmd->blob_hash);
+  if(old && old->mtime == *mtime && old->size == *size)return strdup(old->blob);
+
+  if(st.st_size == 0)return strdup(hexsha1git("blob", NULL, 0));
+  MmapedFile file = readFile(cmd->input_path, true);
+  char* res = strdup(hexsha1git("blob", (uint8_t*)file.data, file.len));
+  closeFile(file);
+  return res;
+}
+
+char* scriptHash(ScriptHash** cache, char* script_path){
+  if(script_path == NULL)return "";
+  ScriptHash* c = shgetp_null(*cache, script_path);
+  if(c)return c->value;
+  // a missing script fails when it's run, like it always did
+  char* hash = strdup(access(script_path, R_OK) == 0 ? base64sha1file(script_path) : "");
+  shput(*cache, script_path, hash);
+  return hash;
+}
+
+BuildRecord* sort_manifest; // qsort() has no context argument
+
+long expectedDuration(BuildRecord* manifest, Command* cmd){
+  // we know nothing about a filter that never ran, so it might as well be the slow one
+  BuildRecord* r = shgetp_null(manifest, cmd->output_path);
+  return r && r->ms ? r->ms : __LONG_MAX__;
+}
+
+int compareJobDurations(const void* a, const void* b){
+  long x = expectedDuration(sort_manifest, ((FilterJob*)a)->cmd);
+  long y = expectedDuration(sort_manifest, ((FilterJob*)b)->cmd);
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+char* resultPath(BuildRecord* rec){
+  // filter outputs are kept by (script, input blob), so the same work is never done twice
+  if(rec->script[0] == '\0' || rec->blob[0] == '\0')return NULL;
+  char* store_dir = storePath("results");
+  char* res = concatStrings((char*[]){store_dir, "/", rec->script, "-", rec->blob, NULL});
+  free(store_dir);
+  return res;
+}
+
+void markUsedResults(ResultUse** used, BuildRecord* manifest){
+  for(int i = 0; i < shlen(manifest); i++){
+    if(manifest[i].script[0] == '\0' || manifest[i].blob[0] == '\0')continue;
+    char* name = concatStrings((char*[]){manifest[i].script, "-", manifest[i].blob, NULL});
+    shput(*used, name, true);
+    free(name);
+  }
+}
+
+void pruneResults(char* output_dir, BuildRecord* manifest){
+  // the link count of a result says nothing, its output might have been moved, deleted, or cloned with FICLONE,
+  // so a result stays while a manifest has an output that was built from it, and for result_max_age after that.
+  // every link to or from it updates its ctime, so that's roughly when it was last used
+  long cutoff = time(NULL) - result_max_age;
+  ResultUse* used = NULL;
+  sh_new_strdup(used);
+  markUsedResults(&used, manifest);
+
+  // the manifests of other output directories count too, unless nothing was built there for as long
+  char* cache_dir = concatStrings((char*[]){getenv("HOME"), "/.cache/sprinkler", NULL});
+  char* own_path = manifestPath(output_dir);
+  DIR* dir = opendir(cache_dir);
+  struct dirent* ent;
+  while(dir && (ent = readdir(dir))){
+    size_t len = strlen(ent->d_name);
+    if(strncmp(ent->d_name, "manifest-", 9) != 0 || len < 4 || strcmp(ent->d_name+len-4, ".tsv") != 0)continue;
+    char* path = concatStrings((char*[]){cache_dir, "/", ent->d_name, NULL});
+    struct stat st;
+    if(strcmp(path, own_path) != 0 && stat(path, &st) == 0 && st.st_mtime >= cutoff){
+      BuildRecord* other = readManifest(path);
+      markUsedResults(&used, other);
+      freeManifest(other);
+    }
+    free(path);
+  }
+  if(dir)closedir(dir);
+  free(own_path);
+  free(cache_dir);
+
+  char* store_dir = storePath("results");
+  dir = opendir(store_dir);
+  while(dir && (ent = readdir(dir))){
+    struct stat st;
+    if(ent->d_name[0] == '.' || shgetp_null(used, ent->d_name) != NULL)continue;
+    if(fstatat(dirfd(dir), ent->d_name, &st, 0) == 0 && st.st_ctime < cutoff)unlinkat(dirfd(dir), ent->d_name, 0);
+  }
+  if(dir)closedir(dir);
+  free(store_dir);
+  shfree(used);
+}
+
+bool reuseResult(Command* cmd, BuildRecord* rec, BuildRecord** manifest){
+  // takes the output from the result store if it's there, rec goes into the manifest if it worked
+  char* result_path = resultPath(rec);
+  if(result_path == NULL || access(result_path, R_OK) != 0){
+    free(result_path);
+    return false;
+  }
+
+  char* name = strrchr(cmd->output_path, '/')+1;
+  fprintf(stderr, INFO"reusing %s from an earlier run on %s\n", name, getTimeString());
+  copyFilter(result_path, cmd->output_path, false, NULL);
+  free(result_path);
+  if(access(cmd->output_path, F_OK) == 0)recordBuild(manifest, rec);
+  else freeBuildRecord(rec);
+  return true;
+}
+
+bool copyDuplicate(FilterJob* dup, FilterJob* filters, BuildRecord** manifest){
+  // when the result couldn't be stored, the output of the filter that did run is just as good.
+  // the records of the filters are gone by now, but one that worked is in the manifest with the same blob
+  for(int i = 0; i < arrlen(filters); i++){
+    BuildRecord* first = shgetp_null(*manifest, filters[i].cmd->output_path);
+    if(first == NULL || strcmp(first->script, dup->rec.script) != 0 || strcmp(first->blob, dup->rec.blob) != 0)continue;
+
+    char* name = strrchr(dup->cmd->output_path, '/')+1;
+    fprintf(stderr, INFO"copying %s from %s on %s\n", name, strrchr(first->key, '/')+1, getTimeString());
+    unlink(dup->cmd->output_path);
+    copyFilter(first->key, dup->cmd->output_path, false, NULL);
+    if(access(dup->cmd->output_path, F_OK) != 0)return false;
+    recordBuild(manifest, &dup->rec);
+    return true;
+  }
+  return false;
+}
+
+void startFilter(FilterJob* job){
+  job->start = timems();
+  // the old output might be a link to a stored result, or to a checkout if it used to be a copy
+  unlink(job->cmd->output_path);
+  // with only one filter at a time there is nothing to interleave with
+  if(parallel_filters > 1)job->err = tmpfile();
+
+  Command* cmd = job->cmd;
+  job->pid = fork();
+  if(job->pid == -1){
+    perror("fork");
+    exit(1);
+  }else if(job->pid == 0){
+    if(job->err)dup2(fileno(job->err), STDERR_FILENO);
+    execvp(cmd->script_path, (char*[]){cmd->script_path, cmd->input_path, cmd->output_path, NULL});
+    perror("execvp");
+    fprintf(stderr, "can't run %s\n", cmd->script_path);
+    exit(1);
+  }
+}
+
+bool finishFilter(FilterJob* job, int status, BuildRecord** manifest){
+  if(job->err){
+    char buf[4096];
+    rewind(job->err);
+    for(size_t len; (len = fread(buf, 1, sizeof(buf), job->err));)fwrite(buf, 1, len, stderr);
+    fclose(job->err);
+  }
+  if(status){
+    if(WIFSIGNALED(status)){
+      fprintf(stderr, "%s was killed by signal %d (%s)\n", job->cmd->script_path, WTERMSIG(status), strsignal(WTERMSIG(status)));
+    }else{
+      fprintf(stderr, "%s exited with code %d\n", job->cmd->script_path, WEXITSTATUS(status));
+    }
+    // so that it gets built again next time
+    BuildRecord* old = shgetp_null(*manifest, job->cmd->output_path);
+    if(old){
+      freeBuildRecord(old);
+      (void)shdel(*manifest, job->cmd->output_path);
+    }
+    freeBuildRecord(&job->rec);
+    return false;
+  }
+  job->rec.ms = timems() - job->start;
+  char* result_path = resultPath(&job->rec);
+  if(result_path){
+    char* tmp_path = concatStrings((char*[]){result_path, ".tmp", NULL});
+    unlink(tmp_path);
+    if(link(job->cmd->output_path, tmp_path) || rename(tmp_path, result_path)){
+      // not fatal, its duplicates get copied from the output instead
+      fprintf(stderr, WARNING"can't store the result of %s for later runs: %m\n", job->cmd->output_path);
+      unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(result_path);
+  }
+  recordBuild(manifest, &job->rec);
+  return true;
+}
+
+bool runCommands(Command* commands, char* output_dir){
+  // an output is only built again if its input blob, its filter script or its arguments changed
+  BuildRecord* manifest = loadManifest(output_dir);
+  ScriptHash* scripts = NULL;
+  sh_new_strdup(scripts);
+  size_t bytes_saved = 0;
+  FilterJob* filters = NULL;
+  FilterJob* duplicates = NULL;
+
   for(int i = 0; i < arrlen(commands); i++){
     Command* cmd = &commands[i];
-    bool input_changed = isOlderThen(cmd->output_path, cmd->input_path);
-    bool script_changed = cmd->script_path && isOlderThen(cmd->output_path, cmd->script_path);
-    if(!input_changed && !script_changed)continue;
+    BuildRecord* old = shgetp_null(manifest, cmd->output_path);
+    BuildRecord rec = {.key = cmd->output_path};
+    rec.blob = inputBlobHash(cmd, old, &rec.mtime, &rec.size);
+    rec.script = strdup(scriptHash(&scripts, cmd->script_path));
+    rec.args = concatStrings((char*[]){cmd->script_path ?: "copy", " ", cmd->input_path, NULL});
+    rec.ms = old ? old->ms : 0;
+    if(rec.blob == NULL)rec.blob = strdup("");
 
+    bool is_current = old && strcmp(old->blob, rec.blob) == 0 && strcmp(old->script, rec.script) == 0 && strcmp(old->args, rec.args) == 0;
+    if(is_current && access(cmd->output_path, F_OK) == 0){
+      // the input may have just been checked out again, with the same contents
+      old->mtime = rec.mtime;
+      old->size = rec.size;
+      freeBuildRecord(&rec);
+      continue;
+    }
+
+    if(cmd->script_path){
+      if(reuseResult(cmd, &rec, &manifest))continue;
+      // the same filter on the same blob waits for the first one, and then reuses its result
+      bool is_duplicate = false;
+      for(int j = 0; j < arrlen(filters) && !is_duplicate && rec.script[0] && rec.blob[0]; j++){
+        is_duplicate = strcmp(filters[j].rec.script, rec.script) == 0 && strcmp(filters[j].rec.blob, rec.blob) == 0;
+      }
+      if(is_duplicate)arrput(duplicates, ((FilterJob){.cmd = cmd, .rec = rec}));
+      else arrput(filters, ((FilterJob){.cmd = cmd, .rec = rec}));
+      continue;
+    }
     char* name = strrchr(cmd->output_path, '/')+1;
     fprintf(stderr, INFO"updating %s on %s\n", name, getTimeString());
+    long start = timems();
+    size_t saved = copyFilter(cmd->input_path, cmd->output_path, true, cmd->blob_hash);
+    bytes_saved += saved;
+    rec.ms = timems() - start;
+    if(access(cmd->output_path, F_OK) == 0)recordBuild(&manifest, &rec);
+    else freeBuildRecord(&rec);
+  }
+
+  if(bytes_saved){
+    fprintf(stderr, INFO"copy saved %zu KiB by sharing data with the checkout\n", bytes_saved/1024);
+  }
+  pruneStore("blobs");
+  pruneResults(output_dir, manifest);
+
+  // the slowest filters go first, so they don't end up running alone at the end
+  sort_manifest = manifest;
+  if(filters)qsort(filters, arrlen(filters), sizeof(FilterJob), compareJobDurations);
+
+  FilterJob* running = NULL;
+  bool failed = false;
+  int next = 0;
+  while(next < arrlen(filters) || arrlen(running)){
+    while(!failed && next < arrlen(filters) && arrlen(running) < parallel_filters){
+      FilterJob* job = &filters[next++];
+      char* name = strrchr(job->cmd->output_path, '/')+1;
+      fprintf(stderr, INFO"updating %s on %s\n", name, getTimeString());
+      startFilter(job);
+      arrput(running, *job);
+    }
+    if(arrlen(running) == 0)break;
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if(pid < 0){
+      perror("waitpid");
+      exit(1);
+    }
+    for(int i = 0; i < arrlen(running); i++){
+      if(running[i].pid != pid)continue;
+      failed |= !finishFilter(&running[i], status, &manifest);
+      arrdelswap(running, i);
+      break;
+    }
+  }
+  for(; next < arrlen(filters); next++){
+    freeBuildRecord(&filters[next].rec);
+  }
+  for(int i = 0; i < arrlen(duplicates); i++){
+    if(reuseResult(duplicates[i].cmd, &duplicates[i].rec, &manifest))continue;
+    if(!copyDuplicate(&duplicates[i], filters, &manifest))freeBuildRecord(&duplicates[i].rec);
+  }
 
-    char* exe = cmd->script_path ?: "cp";
-    execFileSync(exe, (char*[]){exe, cmd->input_path, cmd->output_path, NULL});
+  saveManifest(output_dir, commands, manifest);
+  freeManifest(manifest);
+  for(int i = 0; i < shlen(scripts); i++){
+    free(scripts[i].value);
   }
+  shfree(scripts);
+  arrfree(running);
+  arrfree(filters);
+  arrfree(duplicates);
+  return !failed;
 }
 
 void sprinkle(char* config_path, char* script_path, char* output_path){
   MmapedFile file = readFile(config_path, false);
   RepoList* arr = parseConfig(file.data);
 
-  if(use_custom_git){
-    for(int i = 0; i < shlen(arr); i++){
-      if(arr[i].do_full_clone){
-        fprintf(stderr, WARNING"full clones don't work yet with custom git\n");
-        continue;
-      }
-      ConfigLine* files = arr[i].value;
-      pullObjectCollection_cursed(arr[i].key, (void**)&arr[i].value, sizeof(*files), &files->path_in_repo, &files->src_path);
-    }
-  }else{
-    ensureRepos(arr);
-  }
+  for(int i = 0; i < shlen(arr); i++)arr[i].is_due = true;
+  runRepoJobs(arr, pollRepo);
 
   Command* commands = createCommands(arr, script_path, output_path);
-  runCommands(commands);
+  bool ok = runCommands(commands, output_path);
+  for(int i = 0; i < shlen(arr); i++)ok &= !arr[i].failed;
 
   freeCommands(commands);
   freeConfig(arr);
   closeFile(file);
+  if(!ok)exit(1);
+}
+
+long fileMtime(const char* path){
+  struct stat st;
+  if(stat(path, &st))return 0;
+  return st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+}
+
+long latestScriptChange(RepoList* arr, char* scripts_dir){
+  long res = 0;
+  for(int i = 0; i < shlen(arr); i++){
+    for(int j = 0; j < arrlen(arr[i].value); j++){
+      if(strcmp(arr[i].value[j].filter, "copy") == 0)continue;
+      char* path = concatStrings((char*[]){scripts_dir, "/", arr[i].value[j].filter, NULL});
+      long mtime = fileMtime(path);
+      if(mtime > res)res = mtime;
+      free(path);
+    }
+  }
+  return res;
+}
+
+void daemonize(char* config_path, char* script_path, char* output_path){
+  // the object collections and the ssh masters stay around between pulls,
+  // so an unchanged repo costs one round trip, and nothing else
+  MmapedFile file = {0};
+  RepoList* arr = NULL;
+  long config_mtime = 0;
+  long script_mtime = 0;
+  static char persist[32];
+
+  while(1){
+    bool rebuild = false;
+    long mtime = fileMtime(config_path);
+    if(mtime && mtime != config_mtime){
+      if(config_mtime)fprintf(stderr, INFO"reloading %s\n", config_path);
+      MmapedFile new_file = readFile(config_path, false);
+      RepoList* new_arr = parseConfig(new_file.data);
+      long max_interval = poll_interval;
+      for(int i = 0; i < shlen(new_arr); i++){
+        RepoList* old = shgetp_null(arr, new_arr[i].key);
+        if(old){
+          new_arr[i].goc = old->goc;
+          old->goc = NULL;
+        }
+        if(!new_arr[i].interval)new_arr[i].interval = poll_interval;
+        if(new_arr[i].interval > max_interval)max_interval = new_arr[i].interval;
+      }
+      freeConfig(arr);
+      if(file.data)closeFile(file);
+      file = new_file;
+      arr = new_arr;
+      config_mtime = mtime;
+      rebuild = true;
+
+      snprintf(persist, sizeof(persist), "%lds", max_interval+60);
+      ssh_persist = persist;
+    }
+
+    long now = time(NULL);
+    long next_poll = now + 60; // the config is looked at again at least once a minute
+    for(int i = 0; i < shlen(arr); i++){
+      arr[i].is_due = rebuild || arr[i].next_poll <= now;
+      arr[i].changed = false;
+      if(arr[i].is_due)arr[i].next_poll = now + arr[i].interval;
+      if(arr[i].next_poll < next_poll)next_poll = arr[i].next_poll;
+    }
+    runRepoJobs(arr, pollRepo);
+
+    long new_script_mtime = latestScriptChange(arr, script_path);
+    rebuild |= new_script_mtime != script_mtime;
+    script_mtime = new_script_mtime;
+    for(int i = 0; i < shlen(arr); i++)rebuild |= arr[i].changed;
+
+    if(rebuild){
+      Command* commands = createCommands(arr, script_path, output_path);
+      if(!runCommands(commands, output_path)){
+        fprintf(stderr, WARNING"some filters failed, trying them again at the next change\n");
+      }
+      freeCommands(commands);
+    }
+
+    now = time(NULL);
+    if(next_poll > now)sleep(next_poll - now);
+  }
+}
+
+void ignoreSignal(int sig){
+  (void)sig;
 }
 
 int main(int argc, char** argv){
@@ -306,7 +1161,7 @@ int main(int argc, char** argv){
 
   while(1){
     int optionIndex = 0;
-    int c = getopt_long(argc, argv, "Ghi:s:o:", longOptionRom, &optionIndex);
+    int c = getopt_long(argc, argv, "Ghvdi:s:o:t:p:P:j:I:M:k:", longOptionRom, &optionIndex);
     if(c == -1)break;
     switch(c){
       case 0:
@@ -326,6 +1181,67 @@ int main(int argc, char** argv){
       case 'G':
         use_custom_git = true;
         break;
+      case 'v':
+        verbose = true;
+        break;
+      case 't':
+        pack_threads = atoi(optarg);
+        if(pack_threads < 1){
+          fprintf(stderr, ERROR"invalid thread count '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+
+      case 'p':
+        parallel_repos = atoi(optarg);
+        if(parallel_repos < 1){
+          fprintf(stderr, ERROR"invalid repository count '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'P':
+        connections_per_host = atoi(optarg);
+        if(connections_per_host < 1){
+          fprintf(stderr, ERROR"invalid connection count '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+
+      case 'j':
+        parallel_filters = atoi(optarg);
+        if(parallel_filters < 1){
+          fprintf(stderr, ERROR"invalid filter count '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+
+      case 'd':
+        daemon_mode = true;
+        break;
+      case 'I':
+        poll_interval = parseDuration(optarg);
+        if(poll_interval < 1){
+          fprintf(stderr, ERROR"invalid interval '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+
+      case 'M':{
+        long size = parseSize(optarg);
+        if(size < 1){
+          fprintf(stderr, ERROR"invalid size '%s'\n", optarg);
+          exit(1);
+        }
+        max_blob_size = size;
+        break;
+      }
+      case 'k':
+        keep_commits = atoi(optarg);
+        if(keep_commits < 0 || (keep_commits == 0 && strcmp(optarg, "0") != 0)){
+          fprintf(stderr, ERROR"invalid commit count '%s'\n", optarg);
+          exit(1);
+        }
+        break;
 
       case 'h':
         printf(
@@ -336,6 +1252,17 @@ int main(int argc, char** argv){
           "  -s, --scripts <path>  Path to scripts directory\n"
           "  -o, --output <path>   Path to output www directory\n"
           "  -G, --custom-git      Use my custom implementation of the git protocol\n"
+          "  -v, --verbose         Print statistics from the custom git client\n"
+          "  -t, --threads <n>     Threads used to index git packs, split between the repositories (default: one per core)\n"
+          "  -p, --parallel <n>    Number of repositories synced at once (default: 4)\n"
+          "  -P, --per-host <n>    Number of connections per host at once (default: 2)\n"
+          "  -j, --jobs <n>        Number of filters run at once (default: 1)\n"
+          "  -d, --daemon          Keep running, and pull the repositories every --interval\n"
+          "  -I, --interval <time> Time between pulls, like 30s, 10m or 2h (default: 2h)\n"
+          "  -M, --max-blob-size <size>\n"
+          "                        Skip files bigger than this, like 512k or 10M (with -G)\n"
+          "  -k, --keep-commits <n>\n"
+          "                        Commits kept in the cache with their trees, 0 keeps everything (default: 2)\n"
           "  -h, --help            Output usage information\n"
           // "  -V, --version       output the version number\n"
         );
@@ -346,6 +1273,11 @@ int main(int argc, char** argv){
     }
   }
 
-  sprinkle(config_path, script_path, output_path);
+  // a server that hangs up fails that one pull with EPIPE, instead of killing the process,
+  // and since it's a handler and not SIG_IGN, exec() resets it for the filters
+  signal(SIGPIPE, ignoreSignal);
+
+  if(daemon_mode)daemonize(config_path, script_path, output_path);
+  else sprinkle(config_path, script_path, output_path);
   return 0;
 }
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 #include "util.h"
 #include <stdio.h>
 #include <fcntl.h>
@@ -21,16 +21,26 @@
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 
+bool verbose = false;
+_Thread_local jmp_buf* pull_error = NULL;
+
+void failPull(){
+  // exit() would take the other repos down with it, they might be halfway through their own pulls
+  if(pull_error)longjmp(*pull_error, 1);
+  exit(1);
+}
+
 MmapedFile readFile(char* path, bool doMmap){
-  int fd = open(path, O_RDONLY);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
   if(fd < 0){
     perror(path);
-    exit(1);
+    failPull();
   }
   struct stat stat;
   if(fstat(fd, &stat)){
     perror(path);
-    exit(1);
+    close(fd);
+    failPull();
   }
   size_t len = stat.st_size;
 
@@ -76,7 +86,7 @@ void timer(char* name){
 char* getTimeString(){
   time_t rawtime = time(NULL);
   struct tm* timeinfo = localtime(&rawtime);
-  static char result[30];
+  static _Thread_local char result[30];
   strftime(result, sizeof(result), "\e[36m%d.%m.%Y %T\e[0m", timeinfo);
   return result;
 }
@@ -87,7 +97,7 @@ int execFileSync_status(char* name, char** arr){
 
   if(pid == -1){
     perror("fork");
-    exit(1);
+    failPull();
   }else if(pid > 0){
     int status;
     waitpid(pid, &status, 0);
@@ -104,12 +114,12 @@ void execFileSync(char* name, char** arr){
   int status = execFileSync_status(name, arr);
   if(status){
     fprintf(stderr, "%s exited with code %d\n", name, status);
-    exit(1);
+    failPull();
   }
 }
 
 static char* sha1base64(uint8_t* hash){
-  static char base64[4*((SHA_DIGEST_LENGTH+2)/3)+1];
+  static _Thread_local char base64[4*((SHA_DIGEST_LENGTH+2)/3)+1];
   EVP_EncodeBlock((uint8_t*)base64, hash, SHA_DIGEST_LENGTH);
 
   for(size_t i = 0; i < sizeof(base64); i++){
@@ -136,7 +146,7 @@ char* base64sha1file(char* path){
 }
 
 char* sha1tohex(uint8_t* hash){
-  static char hex[SHA_DIGEST_LENGTH*2+1];
+  static _Thread_local char hex[SHA_DIGEST_LENGTH*2+1];
   for(int i = 0; i < SHA_DIGEST_LENGTH; i++){
     sprintf(hex + i*2, "%02x", hash[i]);
   }
@@ -144,6 +154,22 @@ char* sha1tohex(uint8_t* hash){
   return hex;
 }
 
+static int hexdigit(char c){
+  if(c >= '0' && c <= '9')return c - '0';
+  if(c >= 'a' && c <= 'f')return c - 'a' + 10;
+  return -1;
+}
+
+bool hextosha1(const char* hex, uint8_t* hash){
+  for(int i = 0; i < SHA_DIGEST_LENGTH; i++){
+    int hi = hexdigit(hex[i*2]);
+    int lo = hi < 0 ? -1 : hexdigit(hex[i*2+1]);
+    if(lo < 0)return false;
+    hash[i] = hi << 4 | lo;
+  }
+  return true;
+}
+
 char* hexsha1git(const char* prefix, uint8_t* data, size_t len){
   uint8_t hash[SHA_DIGEST_LENGTH];
   SHA_CTX sha1context = {0};
@@ -159,12 +185,6 @@ char* hexsha1git(const char* prefix, uint8_t* data, size_t len){
   return sha1tohex(hash);
 }
 
-bool isOlderThen(const char* file1, const char* file2){
-  struct stat b1, b2;
-  if(stat(file1, &b1) || stat(file2, &b2))return true; // true, since at least one stat failed
-  return b1.st_mtime < b2.st_mtime;
-}
-
 char* concatStrings(char* const* arr){
   size_t total_len = 0;
   for(int i = 0; arr[i]; i++){
@@ -183,7 +203,7 @@ void mkdir_safe(const char* dir){
   if(mkdir(dir, 0755)){
     if(errno != EEXIST){
       perror(dir);
-      exit(1);
+      failPull();
     }
   }
 }
@@ -198,3 +218,95 @@ void mkdir_parents(char* file_path){
     }
   }
 }
+
+bool hasWildcard(const char* pattern){
+  return strpbrk(pattern, "*?[") != NULL;
+}
+
+static WildcardState Wildcard_closure(const Wildcard* wc, WildcardState state, WildcardState skip_slash){
+  // a run of stars can be skipped all at once, so this has to repeat until nothing changes
+  while(1){
+    WildcardState next = state | (state & wc->skip) << 1 | (state & skip_slash) << 2;
+    if(next == state)return state;
+    state = next;
+  }
+}
+
+bool compileWildcard(Wildcard* wc, const char* pattern){
+  memset(wc, 0, sizeof(Wildcard));
+  int n = 0;
+
+  for(const char* p = pattern; *p; p++){
+    if(n == WILDCARD_MAX_TOKENS)return false;
+    WildcardState bit = (WildcardState)1 << n;
+
+    if(*p == '*'){
+      bool at_start = p == pattern || p[-1] == '/';
+      if(p[1] == '*' && at_start && (p[2] == '/' || p[2] == '\0')){
+        // "**" matches any number of whole directories
+        for(int c = 1; c < 256; c++)wc->stay[c] |= bit;
+        wc->skip |= bit;
+        p++;
+        if(p[1] == '/'){
+          wc->skip_slash |= bit;
+          p++;
+          if(++n == WILDCARD_MAX_TOKENS)return false;
+          wc->advance['/'] |= bit << 1;
+          wc->literal[n] = '/';
+        }
+      }else{
+        while(p[1] == '*')p++;
+        for(int c = 1; c < 256; c++)if(c != '/')wc->stay[c] |= bit;
+        wc->skip |= bit;
+      }
+    }else if(*p == '?'){
+      for(int c = 1; c < 256; c++)if(c != '/')wc->advance[c] |= bit;
+    }else if(*p == '[' && p[1] != '\0' && strchr(p+2, ']')){
+      // a '[' without a closing ']' is taken literally, like the shell does
+      const char* q = p+1;
+      bool negate = *q == '!' || *q == '^';
+      if(negate)q++;
+      bool members[256] = {0};
+      // a ']' right at the start is part of the class
+      do{
+        uint8_t lo = *q;
+        uint8_t hi = lo;
+        if(q[1] == '-' && q[2] != ']' && q[2] != '\0'){
+          hi = q[2];
+          q += 2;
+        }
+        for(int c = lo; c <= hi; c++)members[c] = true;
+        q++;
+      }while(*q != ']' && *q != '\0');
+      if(*q == '\0')return false;
+      for(int c = 1; c < 256; c++)if(c != '/' && members[c] != negate)wc->advance[c] |= bit;
+      p = q;
+    }else{
+      if(*p == '\\' && p[1])p++;
+      wc->advance[(uint8_t)*p] |= bit;
+      wc->literal[n] = *p;
+    }
+    n++;
+  }
+
+  wc->accept = (WildcardState)1 << n;
+  return true;
+}
+
+WildcardState Wildcard_start(const Wildcard* wc){
+  return Wildcard_closure(wc, 1, wc->skip_slash);
+}
+
+WildcardState Wildcard_step(const Wildcard* wc, WildcardState state, const char* str, size_t len){
+  for(size_t i = 0; i < len && state; i++){
+    uint8_t c = str[i];
+    // "**/" can only match nothing right where it starts, not after it has eaten part of a name
+    WildcardState arrived = Wildcard_closure(wc, (state & wc->advance[c]) << 1, wc->skip_slash);
+    state = arrived | Wildcard_closure(wc, state & wc->stay[c], 0);
+  }
+  return state;
+}
+
+bool Wildcard_match(const Wildcard* wc, const char* str){
+  return Wildcard_step(wc, Wildcard_start(wc), str, strlen(str)) & wc->accept;
+}
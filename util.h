@@ -1,5 +1,6 @@
 #pragma once
 
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -20,6 +21,12 @@ typedef struct MmapedFile {
   size_t len;
 } MmapedFile;
 
+extern bool verbose;
+// set while a thread pulls a repo, so that failPull() only ends that pull instead of the whole process
+extern _Thread_local jmp_buf* pull_error;
+
+_Noreturn void failPull();
+
 MmapedFile readFile(char* path, bool doMmap);
 void closeFile(MmapedFile file);
 long timems();
@@ -30,8 +37,27 @@ void execFileSync(char* name, char** arr);
 char* base64sha1string(char* path);
 char* base64sha1file(char* path);
 char* sha1tohex(uint8_t* hash);
+bool hextosha1(const char* hex, uint8_t* hash);
 char* hexsha1git(const char* prefix, uint8_t* data, size_t len);
-bool isOlderThen(const char* file1, const char* file2);
 char* concatStrings(char* const* arr);
 void mkdir_safe(const char* dir);
 void mkdir_parents(char* file_path);
+
+// a path pattern with '*', '?', '[a-z]' and "**", compiled into a bit-parallel automaton
+// with a state per token, so it can't have more than WILDCARD_MAX_TOKENS of them
+#define WILDCARD_MAX_TOKENS 63
+typedef uint64_t WildcardState;
+typedef struct Wildcard {
+  WildcardState advance[256]; // tokens that consume the char and go on to the next one
+  WildcardState stay[256]; // stars, which consume the char and stay where they are
+  WildcardState skip; // stars, which can also match nothing
+  WildcardState skip_slash; // "**/", which can match nothing including the slash
+  WildcardState accept;
+  char literal[WILDCARD_MAX_TOKENS+1]; // the char of every plain token, or '\0'
+} Wildcard;
+
+bool hasWildcard(const char* pattern);
+bool compileWildcard(Wildcard* wc, const char* pattern);
+WildcardState Wildcard_start(const Wildcard* wc);
+WildcardState Wildcard_step(const Wildcard* wc, WildcardState state, const char* str, size_t len);
+bool Wildcard_match(const Wildcard* wc, const char* str);